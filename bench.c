@@ -0,0 +1,299 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "bigint.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+   Benchmarks for the bigint kernels, for catching regressions and tuning the
+   thresholds in bigint.c. Every operation is timed on random operands over a
+   1-2-5 series of sizes, counted in 64-bit words, and written to stdout as a
+   CSV row
+
+       op,x_words,y_words,reps,ns
+
+   where ns is the mean time of one call over reps calls. The arithmetic goes
+   through the _into functions with the same destination each time, as calc
+   uses them, so the rows show the kernels rather than malloc.
+ */
+
+/* Ratio of the operand sizes in the unbalanced shapes. */
+#define UNBALANCED 10
+
+struct operands {
+        bigint_t *x, *y, *z;
+        char *str;
+        int str_len;
+};
+
+struct bench {
+        const char *name;
+        void (*run)(struct operands *op, long reps);
+        bool binary;            /* Whether it takes a y operand. */
+        bool wide;              /* Whether to time an x twice as long. */
+        bool text;              /* Whether it needs x in decimal. */
+        bool enabled;
+};
+
+static void run_add(struct operands *op, long reps)
+{
+        long i;
+
+        for (i = 0; i < reps; i++) {
+                op->z = bigint_add_into(op->z, op->x, op->y);
+        }
+}
+
+static void run_mul(struct operands *op, long reps)
+{
+        long i;
+
+        for (i = 0; i < reps; i++) {
+                op->z = bigint_mul_into(op->z, op->x, op->y);
+        }
+}
+
+static void run_sqr(struct operands *op, long reps)
+{
+        long i;
+
+        for (i = 0; i < reps; i++) {
+                op->z = bigint_sqr_into(op->z, op->x);
+        }
+}
+
+static void run_div(struct operands *op, long reps)
+{
+        long i;
+
+        for (i = 0; i < reps; i++) {
+                op->z = bigint_div_into(op->z, op->x, op->y);
+        }
+}
+
+static void run_create_str(struct operands *op, long reps)
+{
+        long i;
+
+        for (i = 0; i < reps; i++) {
+                bigint_free(op->z);
+                op->z = bigint_create_str(op->str_len, op->str);
+        }
+}
+
+static void run_tostring(struct operands *op, long reps)
+{
+        long i;
+
+        for (i = 0; i < reps; i++) {
+                bigint_tostring(op->x, op->str);
+        }
+}
+
+static struct bench benches[] = {
+        {"add", run_add, true, false, false, false},
+        {"mul", run_mul, true, false, false, false},
+        {"sqr", run_sqr, false, false, false, false},
+        {"div", run_div, true, true, false, false},
+        {"create_str", run_create_str, false, false, true, false},
+        {"tostring", run_tostring, false, false, true, false},
+};
+
+#define BENCHES (int)(sizeof(benches) / sizeof(benches[0]))
+
+static void *xmalloc(size_t n)
+{
+        void *p;
+
+        p = malloc(n);
+        if (p == NULL) {
+                fprintf(stderr, "Out of memory!");
+                exit(1);
+        }
+
+        return p;
+}
+
+/* The xorshift64 generator, with a fixed seed so that runs are comparable. */
+static uint64_t seed = 88172645463325252u;
+
+static uint64_t next_random(void)
+{
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+
+        return seed;
+}
+
+/* Create a random bigint of exactly n words. */
+static bigint_t *create_random(long n)
+{
+        unsigned char *bytes;
+        bigint_t *res;
+        uint64_t w;
+        long i;
+        int j;
+
+        bytes = xmalloc(8 * n);
+        for (i = 0; i < n; i++) {
+                w = next_random();
+                if (i == n - 1) {
+                        w |= (uint64_t)1 << 63;
+                }
+                for (j = 0; j < 8; j++) {
+                        bytes[8 * i + j] = (unsigned char)(w >> (8 * j));
+                }
+        }
+
+        res = bigint_create_raw(8 * n, bytes, false);
+        free(bytes);
+
+        return res;
+}
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Time b on x_words and y_words operands, doubling the number of calls until
+   they take min_time seconds, and write the row. */
+static void measure(struct bench *b, long x_words, long y_words,
+                    double min_time)
+{
+        struct operands op = {0};
+        double start, elapsed;
+        long reps;
+
+        op.x = create_random(x_words);
+        if (b->binary) {
+                op.y = create_random(y_words);
+        }
+        if (b->text) {
+                op.str = xmalloc(bigint_max_stringlen(op.x) + 1);
+                bigint_tostring(op.x, op.str);
+                op.str_len = strlen(op.str);
+        }
+
+        for (reps = 1;; reps *= 2) {
+                start = now();
+                b->run(&op, reps);
+                elapsed = now() - start;
+                if (elapsed >= min_time) {
+                        break;
+                }
+        }
+
+        printf("%s,%ld,%ld,%ld,%.1f\n", b->name, x_words, y_words, reps,
+               elapsed * 1e9 / reps);
+        fflush(stdout);
+
+        bigint_free(op.x);
+        bigint_free(op.y);
+        bigint_free(op.z);
+        free(op.str);
+}
+
+/* Run b on the balanced and unbalanced shapes of n-word operands. */
+static void measure_shapes(struct bench *b, long n, double min_time)
+{
+        if (!b->binary) {
+                measure(b, n, 0, min_time);
+                return;
+        }
+
+        measure(b, n, n, min_time);
+        if (n >= UNBALANCED) {
+                measure(b, n, n / UNBALANCED, min_time);
+        }
+        if (b->wide) {
+                measure(b, 2 * n, n, min_time);
+        }
+}
+
+static void usage(const char *argv0)
+{
+        int i;
+
+        fprintf(stderr, "usage: %s [-m WORDS] [-s SECONDS] [-t N] [OP...]\n"
+                "  -m WORDS    largest operand size (default 10000000)\n"
+                "  -s SECONDS  minimum time per measurement (default 0.2)\n"
+                "  -t N        spread large operations over N threads\n"
+                "  OP          one of",
+                argv0);
+        for (i = 0; i < BENCHES; i++) {
+                fprintf(stderr, " %s", benches[i].name);
+        }
+        fprintf(stderr, "; all by default\n");
+        exit(1);
+}
+
+int main(int argc, char **argv)
+{
+        static const int steps[] = {1, 2, 5};
+        long max_words = 10000000, n, scale;
+        double min_time = 0.2;
+        int i, j, threads = 1;
+        bool all = true;
+        char *end;
+
+        for (i = 1; i < argc; i++) {
+                if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+                        max_words = strtol(argv[++i], &end, 10);
+                        if (*end != '\0' || max_words < 1) {
+                                usage(argv[0]);
+                        }
+                } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+                        min_time = strtod(argv[++i], &end);
+                        if (*end != '\0' || min_time < 0) {
+                                usage(argv[0]);
+                        }
+                } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+                        threads = strtol(argv[++i], &end, 10);
+                        if (*end != '\0' || threads < 1) {
+                                usage(argv[0]);
+                        }
+                } else {
+                        for (j = 0; j < BENCHES; j++) {
+                                if (strcmp(argv[i], benches[j].name) == 0) {
+                                        break;
+                                }
+                        }
+                        if (j == BENCHES) {
+                                usage(argv[0]);
+                        }
+                        benches[j].enabled = true;
+                        all = false;
+                }
+        }
+
+        bigint_set_threads(threads);
+
+        printf("op,x_words,y_words,reps,ns\n");
+
+        for (j = 0; j < BENCHES; j++) {
+                if (!all && !benches[j].enabled) {
+                        continue;
+                }
+                for (scale = 1; scale <= max_words; scale *= 10) {
+                        for (i = 0; i < 3; i++) {
+                                n = scale * steps[i];
+                                if (n <= max_words) {
+                                        measure_shapes(&benches[j], n,
+                                                       min_time);
+                                }
+                        }
+                }
+        }
+
+        return 0;
+}
@@ -1,739 +1,4879 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "bigint.h"
+#include "pool.h"
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
-/* Add n-place integers u and v into (n + 1)-place w. */
-static void algorithm_a(int n, const uint32_t *u, const uint32_t *v,
-                        uint32_t *w)
-{
-        bool carry, carry_a, carry_b;
-        uint32_t sum_a, sum_b;
-        int j;
+/*
+   Limbs are the digits that the kernels below work on. They are 64 bits wide
+   when the compiler has a 128-bit integer type to hold their products, and
+   32 bits otherwise; define BIGINT_LIMB_BITS to choose explicitly. Either
+   way, the API in bigint.h deals in uint32_t.
+ */
+#ifndef BIGINT_LIMB_BITS
+#ifdef __SIZEOF_INT128__
+#define BIGINT_LIMB_BITS 64
+#else
+#define BIGINT_LIMB_BITS 32
+#endif
+#endif
+
+#if BIGINT_LIMB_BITS == 64
+typedef uint64_t limb_t;
+typedef unsigned __int128 dlimb_t;
+#define LIMB_MAX UINT64_MAX
+#define LIMB_DIGITS 20          /* Decimal digits needed for LIMB_MAX. */
+#define DEC_DIGITS 19           /* Decimal digits that always fit a limb. */
+#define DEC_BASE 10000000000000000000u
+#elif BIGINT_LIMB_BITS == 32
+typedef uint32_t limb_t;
+typedef uint64_t dlimb_t;
+#define LIMB_MAX UINT32_MAX
+#define LIMB_DIGITS 10
+#define DEC_DIGITS 9
+#define DEC_BASE 1000000000u
+#else
+#error "BIGINT_LIMB_BITS must be 32 or 64."
+#endif
+
+#define LIMB_BITS BIGINT_LIMB_BITS
+#define LIMB_WORDS (LIMB_BITS / 32)     /* uint32_t words per limb. */
+#define LIMB_BYTES (LIMB_BITS / 8)
+#define HEX_DIGITS (LIMB_BITS / 4)      /* Hex digits per limb. */
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HAVE_LITTLE_ENDIAN
+#endif
+
+#if LIMB_BITS == 64 && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_ADDCARRY_U64
+#endif
 
-        carry = false;
+/*
+   With GCC or Clang on x86-64, add_n(), sub_n() and cmp() also have AVX2 and
+   AVX-512 versions, compiled in regardless of the -m flags and chosen by what
+   the CPU turns out to have. Define BIGINT_NO_SIMD to leave them out.
+ */
+#if defined(HAVE_ADDCARRY_U64) && defined(__GNUC__) && !defined(BIGINT_NO_SIMD)
+#define HAVE_SIMD
+#endif
 
-        for (j = 0; j < n; j++) {
-                sum_a = u[j] + carry;
-                carry_a = (sum_a < u[j]);
+/*
+   Statistics, kept while bigint_set_stats() has them on. Each operation
+   counts its calls and its total time. It also keeps a histogram of its
+   longest operand, where bucket k holds lengths of k bits, that is 2**(k - 1)
+   to 2**k - 1 limbs. The blocks and bytes allocated are counted as well,
+   both for scratch and for bigints. All threads add to the same counters.
+ */
+enum stat_op {
+        STAT_CREATE_STR,
+        STAT_CREATE_HEX,
+        STAT_TOSTRING,
+        STAT_TOHEX,
+        STAT_PRINT,
+        STAT_ADD,
+        STAT_SUB,
+        STAT_MUL,
+        STAT_SQR,
+        STAT_DIV,
+        STAT_POW,
+        STAT_SHIFT,
+        STAT_NEG,
+        STAT_MOD,
+        STAT_MODMUL,
+        STAT_MODPOW,
+        STAT_OPS
+};
+
+static const char *const stat_names[STAT_OPS] = {
+        "create_str", "create_hex", "tostring", "tohex", "print",
+        "add", "sub", "mul", "sqr", "div", "pow", "shift", "neg",
+        "mod", "modmul", "modpow",
+};
+
+#define STAT_BUCKETS 33
+
+struct op_stats {
+        atomic_uint_least64_t calls, ns;
+        atomic_uint_least64_t sizes[STAT_BUCKETS];
+};
 
-                sum_b = sum_a + v[j];
-                carry_b = (sum_b < sum_a);
+static bool stats_on;
+static struct op_stats stats[STAT_OPS];
+static atomic_uint_least64_t stat_allocs, stat_alloc_bytes;
 
-                w[j] = sum_b;
-                assert(carry_a + carry_b <= 1);
-                carry = carry_a + carry_b;
+/* Get the time to pass to stat_stop(), or 0 if statistics are off. */
+static uint64_t stat_start(void)
+{
+        struct timespec ts;
+
+        if (!stats_on) {
+                return 0;
         }
 
-        w[j] = carry;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-/* Compare u with v, returning -1 if u < v, 1 if u > v, and 0 otherwise. */
-static int cmp(int u_len, const uint32_t *u, int v_len, const uint32_t *v)
+/* Count a call of op begun at start, with the longest operand len limbs. */
+static void stat_stop(enum stat_op op, uint64_t start, uint32_t len)
 {
-        int i;
+        struct op_stats *s = &stats[op];
+        int k;
 
-        if (u_len != v_len) {
-                return u_len < v_len ? -1 : 1;
+        if (start == 0) {
+                return;
         }
 
-        for (i = u_len - 1; i >= 0; i--) {
-                if (u[i] != v[i]) {
-                        return u[i] < v[i] ? -1 : 1;
-                }
+        for (k = 0; len != 0; k++) {
+                len >>= 1;
         }
 
-        return 0;
+        atomic_fetch_add_explicit(&s->calls, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&s->ns, stat_start() - start,
+                                  memory_order_relaxed);
+        atomic_fetch_add_explicit(&s->sizes[k], 1, memory_order_relaxed);
 }
 
-/* Compute w = u - v, where u, v, w are n-place integers, and u >= v. */
-static void algorithm_s(int n, const uint32_t *u, const uint32_t *v,
-                        uint32_t *w)
+void bigint_set_stats(bool enable)
 {
-        bool borrow, borrow_a, borrow_b;
-        uint32_t diff_a, diff_b;
-        int j;
+        stats_on = enable;
+}
+
+void bigint_print_stats(FILE *f)
+{
+        uint64_t calls, ns, n;
+        int i, k;
+
+        fprintf(f, "%-10s %12s %14s %12s  %s\n", "op", "calls", "total ms",
+                "mean us", "longest operand in limbs: calls");
+        for (i = 0; i < STAT_OPS; i++) {
+                calls = atomic_load(&stats[i].calls);
+                ns = atomic_load(&stats[i].ns);
+                if (calls == 0) {
+                        continue;
+                }
+                fprintf(f, "%-10s %12" PRIu64 " %14.3f %12.3f ",
+                        stat_names[i], calls, ns * 1e-6, ns * 1e-3 / calls);
+                for (k = 0; k < STAT_BUCKETS; k++) {
+                        n = atomic_load(&stats[i].sizes[k]);
+                        if (n == 0) {
+                                continue;
+                        }
+                        if (k <= 1) {
+                                fprintf(f, " %d:%" PRIu64, k, n);
+                        } else {
+                                fprintf(f, " %" PRIu64 "-%" PRIu64 ":%" PRIu64,
+                                        (uint64_t)1 << (k - 1),
+                                        ((uint64_t)1 << k) - 1, n);
+                        }
+                }
+                fprintf(f, "\n");
+        }
+        fprintf(f, "alloc      %12" PRIu64 " blocks, %" PRIu64 " bytes\n",
+                (uint64_t)atomic_load(&stat_allocs),
+                (uint64_t)atomic_load(&stat_alloc_bytes));
+}
 
-        assert(cmp(n, u, n, v) >= 0 && "Subtraction result would be negative!");
+/*
+   The allocator for bigint_t storage, as set by bigint_set_allocator().
+   Scratch blocks and the caches of powers belong to the library and outlive
+   any one number, so they keep to malloc() through xmalloc().
+ */
+static void *(*alloc_fn)(size_t) = malloc;
+static void *(*realloc_fn)(void *, size_t) = realloc;
+static void (*free_fn)(void *) = free;
 
-        borrow = false;
+void bigint_set_allocator(void *(*alloc)(size_t),
+                          void *(*resize)(void *, size_t),
+                          void (*release)(void *))
+{
+        assert((alloc == NULL) == (resize == NULL) &&
+               (alloc == NULL) == (release == NULL) &&
+               "Allocator hooks must all be given or all be NULL!");
+
+        if (alloc == NULL) {
+                alloc_fn = malloc;
+                realloc_fn = realloc;
+                free_fn = free;
+        } else {
+                alloc_fn = alloc;
+                realloc_fn = resize;
+                free_fn = release;
+        }
+}
 
-        for (j = 0; j < n; j++) {
-                diff_a = u[j] - borrow;
-                borrow_a = (diff_a > u[j]);
+void bigint_free(bigint_t *x)
+{
+        if (x != NULL) {
+                free_fn(x);
+        }
+}
+
+/* Allocate n bytes with alloc, exiting if memory is exhausted. */
+static void *checked_alloc(void *(*alloc)(size_t), size_t n)
+{
+        void *p;
 
-                diff_b = diff_a - v[j];
-                borrow_b = (diff_b > diff_a);
+        p = alloc(n);
+        if (p == NULL) {
+                fprintf(stderr, "Out of memory!");
+                exit(1);
+        }
 
-                w[j] = diff_b;
-                assert(borrow_a + borrow_b <= 1);
-                borrow = borrow_a + borrow_b;
+        if (stats_on) {
+                atomic_fetch_add_explicit(&stat_allocs, 1,
+                                          memory_order_relaxed);
+                atomic_fetch_add_explicit(&stat_alloc_bytes, n,
+                                          memory_order_relaxed);
         }
 
-        assert(!borrow && "Nothing to borrow from!");
+        return p;
 }
 
-/*
-   Multiply 32-bit numbers x and y into 64-bit (z_hi:z_lo).
+static void *xmalloc(size_t n)
+{
+        return checked_alloc(malloc, n);
+}
 
-   This maps to a single instruction on most 32-bit CPUs,
-   including x86 and ARM.
+/*
+   Scratch memory. Temporaries are taken from size-class pools in the calling
+   thread's bigint_ctx_t and returned there when done, so that after warming
+   up, the arithmetic functions do not allocate anything but their results.
+   Class c holds blocks of SCRATCH_MIN << c bytes; a free block stores the
+   pointer to the next one in the same class.
  */
-static void mul_32_by_32(uint32_t x, uint32_t y,
-                         uint32_t *z_hi, uint32_t *z_lo)
+#define SCRATCH_MIN 64
+#define SCRATCH_CLASSES 40
+
+struct bigint_ctx_t {
+        void *pool[SCRATCH_CLASSES];
+};
+
+static _Thread_local bigint_ctx_t default_ctx;
+static _Thread_local bigint_ctx_t *current_ctx;
+
+bigint_ctx_t *bigint_ctx_create(void)
 {
-        uint64_t prod;
+        bigint_ctx_t *ctx;
 
-        prod = (uint64_t)x * y;
+        ctx = xmalloc(sizeof(*ctx));
+        memset(ctx, 0, sizeof(*ctx));
 
-        *z_hi = (uint32_t)(prod >> 32);
-        *z_lo = (uint32_t)prod;
+        return ctx;
 }
 
-/* Multiply m-place u with n-place v, yielding (m + n)-place w. */
-static void algorithm_m(int m, int n, const uint32_t *u, const uint32_t *v,
-                        uint32_t *w)
+/* Free the scratch blocks held by ctx. */
+static void release_pools(bigint_ctx_t *ctx)
 {
-        int i, j;
-        uint32_t k, hi_prod, lo_prod;
-        bool carry_a, carry_b;
+        void *p;
+        int c;
 
-        for (i = 0; i < m; i++) {
-                w[i] = 0;
+        for (c = 0; c < SCRATCH_CLASSES; c++) {
+                while ((p = ctx->pool[c]) != NULL) {
+                        ctx->pool[c] = *(void **)p;
+                        free(p);
+                }
         }
+}
 
-        for (j = 0; j < n; j++) {
-                if (v[j] == 0) {
-                        w[j + m] = 0;
-                        continue;
-                }
+void bigint_ctx_destroy(bigint_ctx_t *ctx)
+{
+        if (ctx == current_ctx) {
+                current_ctx = NULL;
+        }
 
-                k = 0;
-                for (i = 0; i < m; i++) {
-                        mul_32_by_32(u[i], v[j], &hi_prod, &lo_prod);
+        release_pools(ctx);
+        free(ctx);
+}
 
-                        lo_prod += k;
-                        carry_a = (lo_prod < k);
+bigint_ctx_t *bigint_ctx_use(bigint_ctx_t *ctx)
+{
+        bigint_ctx_t *prev = current_ctx;
 
-                        w[i + j] += lo_prod;
-                        carry_b = (w[i + j] < lo_prod);
+        current_ctx = ctx;
 
-                        k = hi_prod + carry_a + carry_b;
-                        assert(k >= hi_prod && "k cannot overflow");
-                }
+        return prev;
+}
 
-                w[j + m] = k;
+/*
+   Parallelism. The recursive algorithms below fork their independent halves
+   as tasks for the pool in pool.c once the operands have PARALLEL_THRESHOLD
+   limbs, which is large enough for a task to outweigh the cost of handing it
+   to another thread. The pool threads run with their default contexts.
+ */
+#ifndef PARALLEL_THRESHOLD
+#define PARALLEL_THRESHOLD (LIMB_BITS == 64 ? 2000 : 4000)
+#endif
+
+static void release_default_ctx(void)
+{
+        release_pools(&default_ctx);
+}
+
+void bigint_set_threads(int threads)
+{
+        pool_stop();
+        pool_start(threads, release_default_ctx);
+}
+
+/* Get the size class for an n-byte block. */
+static int scratch_class(size_t n)
+{
+        int c;
+
+        for (c = 0; (size_t)SCRATCH_MIN << c < n; c++) {
         }
+
+        assert(c < SCRATCH_CLASSES && "Scratch block too large!");
+
+        return c;
 }
 
-/* Divide (u_hi:u:lo) by v, setting q and r to the quotient and remainder. */
-static void div_32_by_16(uint16_t u_hi, uint16_t u_lo, uint16_t v,
-                         uint16_t *q, uint16_t *r)
+/* Get an n-byte scratch block. Release it with scratch_free(p, n). */
+static void *scratch_alloc(size_t n)
 {
-        uint32_t u = ((uint32_t)u_hi << 16) | u_lo;
+        bigint_ctx_t *ctx = current_ctx ? current_ctx : &default_ctx;
+        int c = scratch_class(n);
+        void *p;
 
-        assert(v > 0 && "Division by zero!");
-        assert(u / v <= UINT16_MAX && "Division overflow!");
+        p = ctx->pool[c];
+        if (p == NULL) {
+                return xmalloc((size_t)SCRATCH_MIN << c);
+        }
+
+        ctx->pool[c] = *(void **)p;
 
-        *q = (uint16_t)(u / v);
-        *r = (uint16_t)(u % v);
+        return p;
 }
 
-/* Divide n-place u by v, yielding n-place quotient q and scalar remainder r. */
-static void short_division(int n, uint16_t *u, uint16_t v,
-                           uint16_t *q, uint16_t *r)
+/* Return the n-byte scratch block p to the pool. */
+static void scratch_free(void *p, size_t n)
 {
-        uint16_t k;
-        int i;
+        bigint_ctx_t *ctx = current_ctx ? current_ctx : &default_ctx;
+        int c = scratch_class(n);
 
-        assert(v > 0 && "Division by zero!");
-        assert(n > 0 && "Dividing empty number!");
+        *(void **)p = ctx->pool[c];
+        ctx->pool[c] = p;
+}
 
-        k = 0;
-        for (i = n - 1; i >= 0; i--) {
-                div_32_by_16(k, u[i], v, &q[i], &k);
+#ifdef HAVE_SIMD
+/* Places below which the vector kernels are not worth their setup. */
+#ifndef SIMD_THRESHOLD
+#define SIMD_THRESHOLD 16
+#endif
+
+/*
+   The vector kernels add, subtract or compare n places, n a multiple of the
+   lane count, and take and return a carry or borrow. A block of lanes is added
+   without carries. Each lane that wrapped around generates a carry into the
+   next, and each lane that came to all ones passes an incoming carry on.
+   Adding the generate bits, moved up one lane, to the propagate bits as
+   integers ripples the carries through the mask, so that the bits that
+   changed mark the lanes that take a carry in, and the bit above the lanes is
+   the carry out. Subtraction is the same, with lanes that came to zero
+   passing a borrow on.
+ */
+__attribute__((target("avx512f")))
+static limb_t add_n_avx512(int n, const limb_t *u, const limb_t *v, limb_t *w,
+                           limb_t carry)
+{
+        const __m512i ones = _mm512_set1_epi64(-1);
+        __m512i a, s;
+        unsigned g, p, x;
+        int j;
+
+        for (j = 0; j < n; j += 8) {
+                a = _mm512_loadu_si512(u + j);
+                s = _mm512_add_epi64(a, _mm512_loadu_si512(v + j));
+                g = _mm512_cmplt_epu64_mask(s, a);
+                p = _mm512_cmpeq_epi64_mask(s, ones);
+                x = ((g << 1) | (unsigned)carry) + p;
+                carry = x >> 8;
+                s = _mm512_mask_sub_epi64(s, (__mmask8)(x ^ p), s, ones);
+                _mm512_storeu_si512(w + j, s);
         }
-        *r = k;
+
+        return carry;
 }
 
-/* Count leading zeros in x. x must not be zero. */
-static int leading_zeros(uint16_t x)
+__attribute__((target("avx512f")))
+static limb_t sub_n_avx512(int n, const limb_t *u, const limb_t *v, limb_t *w,
+                           limb_t borrow)
 {
-        int n;
+        const __m512i ones = _mm512_set1_epi64(-1);
+        __m512i a, d;
+        unsigned g, p, x;
+        int j;
 
-        assert(x != 0);
+        for (j = 0; j < n; j += 8) {
+                a = _mm512_loadu_si512(u + j);
+                d = _mm512_sub_epi64(a, _mm512_loadu_si512(v + j));
+                g = _mm512_cmpgt_epu64_mask(d, a);
+                p = _mm512_cmpeq_epi64_mask(d, _mm512_setzero_si512());
+                x = ((g << 1) | (unsigned)borrow) + p;
+                borrow = x >> 8;
+                d = _mm512_mask_add_epi64(d, (__mmask8)(x ^ p), d, ones);
+                _mm512_storeu_si512(w + j, d);
+        }
 
-        n = 0;
-        while (x <= UINT16_MAX / 2) {
-                x <<= 1;
-                n++;
+        return borrow;
+}
+
+/* Find the highest place where n-place u and v differ, or return -1. */
+__attribute__((target("avx512f")))
+static int mismatch_avx512(int n, const limb_t *u, const limb_t *v)
+{
+        unsigned ne;
+        int j;
+
+        for (j = n - 8; j >= 0; j -= 8) {
+                ne = _mm512_cmpneq_epu64_mask(_mm512_loadu_si512(u + j),
+                                              _mm512_loadu_si512(v + j));
+                if (ne != 0) {
+                        return j + 31 - __builtin_clz(ne);
+                }
         }
 
-        return n;
+        return -1;
 }
 
-/* Shift n-place u m positions to the left. */
-static void shift_left(int n, uint16_t *u, int m)
+/* AVX2 has neither unsigned compares nor mask registers, so the compares are
+   made signed by flipping the top bits, and the masks become lanes of ones. */
+__attribute__((target("avx2")))
+static __m256i lanes_avx2(unsigned mask)
 {
-        uint16_t k, t;
-        int i;
+        const __m256i bits = _mm256_set_epi64x(8, 4, 2, 1);
 
-        assert(m > 0);
-        assert(m < 16);
+        return _mm256_cmpeq_epi64(_mm256_and_si256(_mm256_set1_epi64x(mask),
+                                                   bits), bits);
+}
 
-        k = 0;
-        for (i = 0; i < n; i++) {
-                t = u[i] >> (16 - m);
-                u[i] = (u[i] << m) | k;
-                k = t;
+__attribute__((target("avx2")))
+static limb_t add_n_avx2(int n, const limb_t *u, const limb_t *v, limb_t *w,
+                         limb_t carry)
+{
+        const __m256i ones = _mm256_set1_epi64x(-1);
+        const __m256i top = _mm256_set1_epi64x(INT64_MIN);
+        __m256i a, s;
+        unsigned g, p, x;
+        int j;
+
+        for (j = 0; j < n; j += 4) {
+                a = _mm256_loadu_si256((const __m256i *)(u + j));
+                s = _mm256_add_epi64(a, _mm256_loadu_si256((const __m256i *)
+                                                           (v + j)));
+                g = _mm256_movemask_pd(_mm256_castsi256_pd(
+                        _mm256_cmpgt_epi64(_mm256_xor_si256(a, top),
+                                           _mm256_xor_si256(s, top))));
+                p = _mm256_movemask_pd(_mm256_castsi256_pd(
+                        _mm256_cmpeq_epi64(s, ones)));
+                x = ((g << 1) | (unsigned)carry) + p;
+                carry = x >> 4;
+                s = _mm256_sub_epi64(s, lanes_avx2(x ^ p));
+                _mm256_storeu_si256((__m256i *)(w + j), s);
         }
 
-        assert(k == 0 && "Leftover carry!");
+        return carry;
 }
 
-/* Shift n-place u m positions to the right. */
-static void shift_right(int n, uint16_t *u, int m)
+__attribute__((target("avx2")))
+static limb_t sub_n_avx2(int n, const limb_t *u, const limb_t *v, limb_t *w,
+                         limb_t borrow)
 {
-        uint16_t k, t;
-        int i;
+        const __m256i top = _mm256_set1_epi64x(INT64_MIN);
+        __m256i a, d;
+        unsigned g, p, x;
+        int j;
 
-        assert(m > 0);
-        assert(m < 16);
+        for (j = 0; j < n; j += 4) {
+                a = _mm256_loadu_si256((const __m256i *)(u + j));
+                d = _mm256_sub_epi64(a, _mm256_loadu_si256((const __m256i *)
+                                                           (v + j)));
+                g = _mm256_movemask_pd(_mm256_castsi256_pd(
+                        _mm256_cmpgt_epi64(_mm256_xor_si256(d, top),
+                                           _mm256_xor_si256(a, top))));
+                p = _mm256_movemask_pd(_mm256_castsi256_pd(
+                        _mm256_cmpeq_epi64(d, _mm256_setzero_si256())));
+                x = ((g << 1) | (unsigned)borrow) + p;
+                borrow = x >> 4;
+                d = _mm256_add_epi64(d, lanes_avx2(x ^ p));
+                _mm256_storeu_si256((__m256i *)(w + j), d);
+        }
 
-        k = 0;
-        for (i = n - 1; i >= 0; i--) {
-                t = u[i] << (16 - m);
-                u[i] = (u[i] >> m) | k;
-                k = t;
+        return borrow;
+}
+
+__attribute__((target("avx2")))
+static int mismatch_avx2(int n, const limb_t *u, const limb_t *v)
+{
+        unsigned ne;
+        int j;
+
+        for (j = n - 4; j >= 0; j -= 4) {
+                ne = ~_mm256_movemask_pd(_mm256_castsi256_pd(
+                        _mm256_cmpeq_epi64(
+                                _mm256_loadu_si256((const __m256i *)(u + j)),
+                                _mm256_loadu_si256((const __m256i *)(v + j)))))
+                     & 15;
+                if (ne != 0) {
+                        return j + 31 - __builtin_clz(ne);
+                }
         }
 
-        assert(k == 0 && "Leftover carry!");
+        return -1;
 }
 
 /*
-   Divide (m + n)-place u by n-place v, yielding (m + 1)-place quotient q and
-   n-place remainder u. u must have room for an (m + n + 1)th element.
+   Add the low n - n % 8 places of u and v into w with the widest kernel that
+   the CPU has, and return how many places that was, setting *carry. If there
+   is none, return 0 and leave the whole addition for the caller.
  */
-static void algorithm_d(int m, int n, uint16_t *u, uint16_t *v, uint16_t *q)
+static int add_n_simd(int n, const limb_t *u, const limb_t *v, limb_t *w,
+                      unsigned char *carry)
 {
-        int shift;
-        int j, i;
-        uint32_t qhat, rhat, p, t;
-        uint16_t k, k2, d;
+        n -= n % 8;
+        if (__builtin_cpu_supports("avx512f")) {
+                *carry = add_n_avx512(n, u, v, w, 0);
+        } else if (__builtin_cpu_supports("avx2")) {
+                *carry = add_n_avx2(n, u, v, w, 0);
+        } else {
+                return 0;
+        }
 
-        assert(n > 0 && "v must be greater than zero!");
-        assert(v[n - 1] != 0 && "v must not have leading zeros!");
+        return n;
+}
 
-        if (n == 1) {
-                short_division(m + n, u, v[0], q, &u[0]);
-                return;
+/* Subtract as add_n_simd() adds. */
+static int sub_n_simd(int n, const limb_t *u, const limb_t *v, limb_t *w,
+                      unsigned char *borrow)
+{
+        n -= n % 8;
+        if (__builtin_cpu_supports("avx512f")) {
+                *borrow = sub_n_avx512(n, u, v, w, 0);
+        } else if (__builtin_cpu_supports("avx2")) {
+                *borrow = sub_n_avx2(n, u, v, w, 0);
+        } else {
+                return 0;
         }
 
-        /* Normalize. */
-        u[m + n] = 0;
-        shift = leading_zeros(v[n-1]);
-        if (shift) {
-                shift_left(n, v, shift);
-                shift_left(m + n + 1, u, shift);
+        return n;
+}
+
+/* Find the highest place where n-place u and v differ, or return -1. */
+static int mismatch(int n, const limb_t *u, const limb_t *v)
+{
+        int r = n % 8, i = -1;
+
+        if (__builtin_cpu_supports("avx512f")) {
+                i = mismatch_avx512(n - r, u + r, v + r);
+        } else if (__builtin_cpu_supports("avx2")) {
+                i = mismatch_avx2(n - r, u + r, v + r);
+        } else {
+                r = n;
+        }
+        if (i >= 0) {
+                return i + r;
         }
 
-        for (j = m; j >= 0; j--) {
-                /* Calculate qhat. */
-                t = ((uint32_t)u[j + n] << 16) | u[j + n - 1];
-                qhat = t / v[n - 1];
-                rhat = t % v[n - 1];
-
-                while (true) {
-                        assert(n >= 2);
-                        if (qhat > UINT16_MAX ||
-                            qhat * v[n - 2] > ((rhat << 16) | u[j + n - 2])) {
-                                qhat--;
-                                rhat += v[n - 1];
-                                if (rhat <= UINT16_MAX) {
-                                        continue;
-                                }
-                        }
-                        break;
-                }
+        for (i = r - 1; i >= 0 && u[i] == v[i]; i--) {
+        }
 
-                /* Multiply and subtract. */
-                k = 0;
-                for (i = 0; i <= n; i++) {
-                        p = qhat * (i == n ? 0 : v[i]);
-                        k2 = (p >> 16);
+        return i;
+}
+#endif
 
-                        d = u[j + i] - (uint16_t)p;
-                        k2 += (d > u[j + i]);
 
-                        u[j + i] = d - k;
-                        k2 += (u[j + i] > d);
+/* Compute w = u + v mod 2**(LIMB_BITS * n) for n-place u, v and w. Returns
+   the carry. */
+static limb_t add_n(int n, const limb_t *u, const limb_t *v, limb_t *w)
+{
+#ifdef HAVE_ADDCARRY_U64
+        unsigned long long sum;
+        unsigned char carry;
+        int j;
 
-                        k = k2;
-                }
+        carry = 0;
+        j = 0;
+#ifdef HAVE_SIMD
+        if (n >= SIMD_THRESHOLD) {
+                j = add_n_simd(n, u, v, w, &carry);
+        }
+#endif
+        for (; j < n; j++) {
+                carry = _addcarry_u64(carry, u[j], v[j], &sum);
+                w[j] = sum;
+        }
 
-                /* Test remainder. */
-                q[j] = qhat;
-                if (k != 0) {
-                        /* Add back. */
-                        q[j]--;
-                        k = 0;
-                        for (i = 0; i < n; i++) {
-                                t = u[j + i] + v[i] + k;
-                                u[j + i] = (uint16_t)t;
-                                k = t >> 16;
-                        }
-                        u[j + n] += k;
+        return carry;
+#else
+        limb_t carry, sum;
+        int j;
+
+        carry = 0;
+        for (j = 0; j < n; j++) {
+                sum = u[j] + carry;
+                carry = (sum < carry);
+                w[j] = sum + v[j];
+                carry += (w[j] < sum);
+        }
+
+        return carry;
+#endif
+}
+
+/* Compute w = u - v mod 2**(LIMB_BITS * n) for n-place u, v and w. Returns
+   the borrow. */
+static limb_t sub_n(int n, const limb_t *u, const limb_t *v, limb_t *w)
+{
+#ifdef HAVE_ADDCARRY_U64
+        unsigned long long diff;
+        unsigned char borrow;
+        int j;
+
+        borrow = 0;
+        j = 0;
+#ifdef HAVE_SIMD
+        if (n >= SIMD_THRESHOLD) {
+                j = sub_n_simd(n, u, v, w, &borrow);
+        }
+#endif
+        for (; j < n; j++) {
+                borrow = _subborrow_u64(borrow, u[j], v[j], &diff);
+                w[j] = diff;
+        }
+
+        return borrow;
+#else
+        limb_t borrow, diff;
+        int j;
+
+        borrow = 0;
+        for (j = 0; j < n; j++) {
+                diff = u[j] - borrow;
+                borrow = (diff > u[j]);
+                w[j] = diff - v[j];
+                borrow += (w[j] > diff);
+        }
+
+        return borrow;
+#endif
+}
+
+/* Add m-place u and n-place v, where m >= n, into (m + 1)-place w. w may be
+   the same as u or v. */
+static void algorithm_a(int m, const limb_t *u, int n, const limb_t *v,
+                        limb_t *w)
+{
+        limb_t carry;
+        int j;
+
+        assert(m >= n);
+
+        carry = add_n(n, u, v, w);
+        for (j = n; j < m && carry; j++) {
+                w[j] = u[j] + 1;
+                carry = (w[j] == 0);
+        }
+        if (w != u) {
+                memcpy(w + j, u + j, sizeof(w[0]) * (m - j));
+        }
+        w[m] = carry;
+}
+
+/* Compare u with v, returning -1 if u < v, 1 if u > v, and 0 otherwise. */
+static int cmp(int u_len, const limb_t *u, int v_len, const limb_t *v)
+{
+        int i;
+
+        if (u_len != v_len) {
+                return u_len < v_len ? -1 : 1;
+        }
+
+        i = u_len - 1;
+#ifdef HAVE_SIMD
+        /* Vectors only pay off once the top places turn out equal. */
+        if (u_len >= SIMD_THRESHOLD && u[i] == v[i]) {
+                i = mismatch(u_len, u, v);
+        }
+#endif
+        for (; i >= 0; i--) {
+                if (u[i] != v[i]) {
+                        return u[i] < v[i] ? -1 : 1;
                 }
         }
 
-        /* Unnormalize. */
-        if (shift) {
-                shift_right(n, u, shift);
+        return 0;
+}
+
+/* Compute m-place w = u - v for m-place u and n-place v, where m >= n and
+   u >= v. w may be the same as u or v. */
+static void algorithm_s(int m, const limb_t *u, int n, const limb_t *v,
+                        limb_t *w)
+{
+        limb_t borrow, d;
+        int j;
+
+        assert(cmp(m, u, n, v) >= 0 && "Subtraction result would be negative!");
+
+        borrow = sub_n(n, u, v, w);
+        for (j = n; j < m && borrow; j++) {
+                d = u[j];
+                w[j] = d - 1;
+                borrow = (d == 0);
         }
+        if (w != u) {
+                memcpy(w + j, u + j, sizeof(w[0]) * (m - j));
+        }
+
+        assert(!borrow && "Nothing to borrow from!");
+}
+
+/*
+   Multiply m-place u with n-place v, yielding (m + n)-place w.
+
+   The double-limb product maps to a single instruction on most CPUs (mul, or
+   mulx when compiling for BMI2), and the sum
+   u[i] * v[j] + w[i + j] + k <= (2**LIMB_BITS - 1)**2 + 2 * (2**LIMB_BITS - 1)
+   cannot overflow it.
+ */
+static void algorithm_m(int m, int n, const limb_t *u, const limb_t *v,
+                        limb_t *w)
+{
+        int i, j;
+        limb_t k;
+        dlimb_t t;
+
+        for (i = 0; i < m; i++) {
+                w[i] = 0;
+        }
+
+        for (j = 0; j < n; j++) {
+                if (v[j] == 0) {
+                        w[j + m] = 0;
+                        continue;
+                }
+
+                k = 0;
+                for (i = 0; i < m; i++) {
+                        t = (dlimb_t)u[i] * v[j] + w[i + j] + k;
+                        w[i + j] = (limb_t)t;
+                        k = (limb_t)(t >> LIMB_BITS);
+                }
+
+                w[j + m] = k;
+        }
+}
+
+/*
+   Square n-place u, yielding 2n-place w. Each product u[i] * u[j] with i < j
+   occurs twice in the square, so these are summed once and doubled before
+   the squares u[i] * u[i] are added, for about half the work of
+   algorithm_m.
+ */
+static void algorithm_sqr(int n, const limb_t *u, limb_t *w)
+{
+        int i, j;
+        limb_t k, top;
+        dlimb_t t, s;
+
+        memset(w, 0, sizeof(w[0]) * 2 * n);
+
+        for (i = 0; i < n; i++) {
+                if (u[i] == 0) {
+                        continue;
+                }
+
+                k = 0;
+                for (j = i + 1; j < n; j++) {
+                        t = (dlimb_t)u[i] * u[j] + w[i + j] + k;
+                        w[i + j] = (limb_t)t;
+                        k = (limb_t)(t >> LIMB_BITS);
+                }
+
+                w[i + n] = k;
+        }
+
+        /* Double. The sum is below u**2 / 2, so no bit is shifted out. */
+        top = 0;
+        for (i = 0; i < 2 * n; i++) {
+                k = w[i];
+                w[i] = (k << 1) | top;
+                top = k >> (LIMB_BITS - 1);
+        }
+
+        k = 0;
+        for (i = 0; i < n; i++) {
+                t = (dlimb_t)u[i] * u[i];
+                s = (dlimb_t)w[2 * i] + (limb_t)t + k;
+                w[2 * i] = (limb_t)s;
+                s = (dlimb_t)w[2 * i + 1] + (limb_t)(t >> LIMB_BITS) +
+                    (limb_t)(s >> LIMB_BITS);
+                w[2 * i + 1] = (limb_t)s;
+                k = (limb_t)(s >> LIMB_BITS);
+        }
+
+        assert(k == 0);
+}
+
+/*
+   Operand sizes, in limbs, at which mul() switches from algorithm_m to
+   Karatsuba and from Karatsuba to Toom-3. Both can be overridden at compile
+   time to tune the crossovers for a particular machine.
+ */
+#ifndef KARATSUBA_THRESHOLD
+#define KARATSUBA_THRESHOLD 32
+#endif
+
+#ifndef TOOM3_THRESHOLD
+#define TOOM3_THRESHOLD (LIMB_BITS == 64 ? 64 : 160)
+#endif
+
+#if KARATSUBA_THRESHOLD < 4 || TOOM3_THRESHOLD < KARATSUBA_THRESHOLD
+#error "Karatsuba needs at least 4 places, and must come before Toom-3."
+#endif
+
+/* The same crossovers for squaring, where algorithm_sqr() holds out longer. */
+#ifndef SQR_KARATSUBA_THRESHOLD
+#define SQR_KARATSUBA_THRESHOLD 48
+#endif
+
+#ifndef SQR_TOOM3_THRESHOLD
+#define SQR_TOOM3_THRESHOLD (LIMB_BITS == 64 ? 96 : 200)
+#endif
+
+#if SQR_KARATSUBA_THRESHOLD < 4 || SQR_TOOM3_THRESHOLD < SQR_KARATSUBA_THRESHOLD
+#error "Karatsuba needs at least 4 places, and must come before Toom-3."
+#endif
+
+/* Add n-place v into m-place w, m >= n. Returns the carry out of w. */
+static limb_t add_in(int m, limb_t *w, int n, const limb_t *v)
+{
+        limb_t carry;
+        int j;
+
+        assert(m >= n);
+
+        carry = add_n(n, w, v, w);
+        for (j = n; carry && j < m; j++) {
+                carry = (++w[j] == 0);
+        }
+
+        return carry;
+}
+
+/* Subtract n-place v from m-place w, m >= n. Returns the borrow out of w. */
+static limb_t sub_in(int m, limb_t *w, int n, const limb_t *v)
+{
+        limb_t borrow;
+        int j;
+
+        assert(m >= n);
+
+        borrow = sub_n(n, w, v, w);
+        for (j = n; borrow && j < m; j++) {
+                borrow = (w[j]-- == 0);
+        }
+
+        return borrow;
+}
+
+/* Copy n-place u into m-place w, padding with zeros. */
+static void zero_extend(int m, limb_t *w, int n, const limb_t *u)
+{
+        assert(m >= n);
+
+        memcpy(w, u, sizeof(w[0]) * n);
+        memset(w + n, 0, sizeof(w[0]) * (m - n));
+}
+
+/* Negate the n-place two's complement integer w. */
+static void negate(int n, limb_t *w)
+{
+        int j;
+
+        for (j = 0; j < n && w[j] == 0; j++) {
+        }
+
+        if (j < n) {
+                w[j] = -w[j];
+                for (j++; j < n; j++) {
+                        w[j] = ~w[j];
+                }
+        }
+}
+
+/* Replace the n-place two's complement w by its magnitude; true if w < 0. */
+static bool tc_abs(int n, limb_t *w)
+{
+        if (w[n - 1] >> (LIMB_BITS - 1)) {
+                negate(n, w);
+                return true;
+        }
+
+        return false;
+}
+
+/* Shift the n-place two's complement w one bit to the right, keeping sign. */
+static void tc_halve(int n, limb_t *w)
+{
+        limb_t sign = w[n - 1] & ((limb_t)1 << (LIMB_BITS - 1));
+        int j;
+
+        for (j = 0; j < n - 1; j++) {
+                w[j] = (w[j] >> 1) | (w[j + 1] << (LIMB_BITS - 1));
+        }
+        w[n - 1] = (w[n - 1] >> 1) | sign;
+}
+
+/* Divide the n-place two's complement w by 3. The division must be exact. */
+static void tc_divexact_by3(int n, limb_t *w)
+{
+        const limb_t inv3 = LIMB_MAX / 3 * 2 + 1;      /* 3 * inv3 == 1 */
+        limb_t k, s, q;
+        bool borrow;
+        int j;
+
+        /* Work 2-adically from the bottom: q[j] = (w[j] - k) / 3 mod
+           2**LIMB_BITS, where k collects the borrow and the overflow of the
+           3 * q[j - 1]. */
+        k = 0;
+        for (j = 0; j < n; j++) {
+                s = w[j] - k;
+                borrow = (s > w[j]);
+
+                q = s * inv3;
+                w[j] = q;
+
+                k = borrow + (q > LIMB_MAX / 3) + (q > LIMB_MAX / 3 * 2);
+        }
+}
+
+static void mul(int m, int n, const limb_t *u, const limb_t *v,
+                limb_t *w);
+static void sqr(int n, const limb_t *u, limb_t *w);
+
+/* A product for mul_fork() and mul_join(). */
+struct mul_task {
+        struct pool_task task;
+        int m, n;
+        const limb_t *u, *v;
+        limb_t *w;
+};
+
+static void mul_run(void *arg)
+{
+        struct mul_task *t = arg;
+
+        mul(t->m, t->n, t->u, t->v, t->w);
+}
+
+/* Start computing w = u * v as by mul(), as a pool task if the operands are
+   large enough. Finish with mul_join(t). */
+static void mul_fork(struct mul_task *t, int m, int n, const limb_t *u,
+                     const limb_t *v, limb_t *w)
+{
+        t->m = m;
+        t->n = n;
+        t->u = u;
+        t->v = v;
+        t->w = w;
+
+        if ((m < n ? m : n) < PARALLEL_THRESHOLD) {
+                mul_run(t);
+                t->task.fn = NULL;
+                return;
+        }
+
+        pool_fork(&t->task, mul_run, t);
+}
+
+static void mul_join(struct mul_task *t)
+{
+        if (t->task.fn != NULL) {
+                pool_join(&t->task);
+        }
+}
+
+/*
+   Finish a Karatsuba product in len-place w, which holds u0*v0 in its low 2h
+   places and u1*v1 above them, from z_len-place z = (u0 + u1)*(v0 + v1).
+ */
+static void karatsuba_finish(int len, int h, limb_t *w, int z_len, limb_t *z)
+{
+        /* z = (u0 + u1)*(v0 + v1) - u0*v0 - u1*v1 = u0*v1 + u1*v0 */
+        sub_in(z_len, z, 2 * h, w);
+        sub_in(z_len, z, len - 2 * h, w + 2 * h);
+
+        /* w += z * 2**(LIMB_BITS * h) */
+        while (z_len > len - h) {
+                assert(z[z_len - 1] == 0 && "Middle product too large!");
+                z_len--;
+        }
+        add_in(len - h, w + h, z_len, z);
+}
+
+/*
+   Multiply m-place u with n-place v, yielding (m + n)-place w, where
+   n <= m < 2n - 1. Splitting both at h places gives three half-size
+   products: u0*v0, u1*v1 and (u0 + u1)*(v0 + v1).
+ */
+static void karatsuba(int m, int n, const limb_t *u, const limb_t *v,
+                      limb_t *w)
+{
+        int h = (m + 1) / 2;
+        int z_len = 2 * h + 2;
+        size_t size = sizeof(limb_t) * (2 * (h + 1) + z_len);
+        struct mul_task t0, t1;
+        limb_t *su, *sv, *z;
+
+        assert(n <= m && h < n);
+
+        su = scratch_alloc(size);
+        sv = su + h + 1;
+        z = sv + h + 1;
+
+        /* su = u0 + u1, sv = v0 + v1 */
+        memcpy(su, u, sizeof(su[0]) * h);
+        su[h] = add_in(h, su, m - h, u + h);
+        memcpy(sv, v, sizeof(sv[0]) * h);
+        sv[h] = add_in(h, sv, n - h, v + h);
+
+        /* w = u0*v0 + u1*v1 * 2**(2 * LIMB_BITS * h) */
+        mul_fork(&t0, h, h, u, v, w);
+        mul_fork(&t1, m - h, n - h, u + h, v + h, w + 2 * h);
+
+        mul(h + 1, h + 1, su, sv, z);
+        mul_join(&t1);
+        mul_join(&t0);
+        karatsuba_finish(m + n, h, w, z_len, z);
+
+        scratch_free(su, size);
+}
+
+/* Square n-place u into 2n-place w as by karatsuba(), from the squares of
+   u0, u1 and u0 + u1. */
+static void sqr_karatsuba(int n, const limb_t *u, limb_t *w)
+{
+        int h = (n + 1) / 2;
+        int z_len = 2 * h + 2;
+        size_t size = sizeof(limb_t) * (h + 1 + z_len);
+        struct mul_task t0, t1;
+        limb_t *su, *z;
+
+        assert(h < n);
+
+        su = scratch_alloc(size);
+        z = su + h + 1;
+
+        memcpy(su, u, sizeof(su[0]) * h);
+        su[h] = add_in(h, su, n - h, u + h);
+
+        mul_fork(&t0, h, h, u, u, w);
+        mul_fork(&t1, n - h, n - h, u + h, u + h, w + 2 * h);
+        sqr(h + 1, su, z);
+        mul_join(&t1);
+        mul_join(&t0);
+        karatsuba_finish(2 * n, h, w, z_len, z);
+
+        scratch_free(su, size);
+}
+
+/*
+   Finish a Toom-3 product in len-place w, which holds r(0) in its low 2k
+   places and r(inf) from place 4k, given the l-place two's complement values
+   r1 = r(1), rm1 = r(-1) and rm2 = r(-2). r is l places of scratch.
+ */
+static void toom3_finish(int len, int k, limb_t *w, int l, limb_t *r1,
+                         limb_t *rm1, limb_t *rm2, limb_t *r)
+{
+        /* Interpolate. On exit, r1, rm1 and rm2 hold the coefficients of
+           x**1, x**2 and x**3 respectively. */
+        sub_n(l, rm2, r1, rm2);                 /* rm2 = (r(-2) - r(1)) / 3 */
+        tc_divexact_by3(l, rm2);
+        sub_n(l, r1, rm1, r1);                  /* r1 = (r(1) - r(-1)) / 2 */
+        tc_halve(l, r1);
+        zero_extend(l, r, 2 * k, w);            /* rm1 = r(-1) - r(0) */
+        sub_n(l, rm1, r, rm1);
+        sub_n(l, rm1, rm2, rm2);                /* rm2 = (rm1 - rm2) / 2 */
+        tc_halve(l, rm2);
+        zero_extend(l, r, len - 4 * k, w + 4 * k);
+        add_n(l, rm2, r, rm2);                  /* rm2 += 2 * r(inf) */
+        add_n(l, rm2, r, rm2);
+        add_n(l, rm1, r1, rm1);                 /* rm1 += r1 - r(inf) */
+        sub_n(l, rm1, r, rm1);
+        sub_n(l, r1, rm2, r1);                  /* r1 -= rm2 */
+
+        /* Recompose. */
+        add_in(len - k, w + k, l, r1);
+        add_in(len - 2 * k, w + 2 * k, l, rm1);
+        while (l > len - 3 * k) {
+                assert(rm2[l - 1] == 0 && "Coefficient too large!");
+                l--;
+        }
+        add_in(len - 3 * k, w + 3 * k, l, rm2);
+}
+
+/*
+   Multiply m-place u with n-place v, yielding (m + n)-place w, where v has
+   more than 2k places for k = ceil(m / 3). Both are split into three k-place
+   parts and treated as polynomials, which are evaluated at 0, 1, -1, -2 and
+   infinity, multiplied pointwise, and interpolated back (Bodrato's sequence).
+ */
+static void toom3(int m, int n, const limb_t *u, const limb_t *v,
+                  limb_t *w)
+{
+        int k = (m + 2) / 3;
+        int e = k + 1;          /* Evaluations fit in (k + 1)-place two's
+                                   complement: |u0 - 2u1 + 4u2| < 5 * 2**(LIMB_BITS * k). */
+        int l = 2 * e;          /* So do the coefficients at 2k + 2 places. */
+        size_t size = sizeof(limb_t) * (7 * e + 4 * l);
+        limb_t *up1, *um1, *um2, *vp1, *vm1, *vm2, *t;
+        limb_t *r1, *rm1, *rm2, *r;
+        struct mul_task tasks[4];
+        bool neg1, neg2;
+        int i;
+
+        assert(n <= m && 2 * k < n);
+
+        up1 = scratch_alloc(size);
+        um1 = up1 + e;
+        um2 = um1 + e;
+        vp1 = um2 + e;
+        vm1 = vp1 + e;
+        vm2 = vm1 + e;
+        t = vm2 + e;
+        r1 = t + e;
+        rm1 = r1 + l;
+        rm2 = rm1 + l;
+        r = rm2 + l;
+
+        /* Evaluate u and v at 1, -1 and -2. */
+        zero_extend(e, t, k, u);
+        add_in(e, t, m - 2 * k, u + 2 * k);
+        zero_extend(e, up1, k, u + k);
+        sub_n(e, t, up1, um1);
+        add_n(e, t, up1, up1);
+        zero_extend(e, um2, m - 2 * k, u + 2 * k);
+        add_n(e, um1, um2, um2);
+        add_n(e, um2, um2, um2);
+        zero_extend(e, t, k, u);
+        sub_n(e, um2, t, um2);
+
+        zero_extend(e, t, k, v);
+        add_in(e, t, n - 2 * k, v + 2 * k);
+        zero_extend(e, vp1, k, v + k);
+        sub_n(e, t, vp1, vm1);
+        add_n(e, t, vp1, vp1);
+        zero_extend(e, vm2, n - 2 * k, v + 2 * k);
+        add_n(e, vm1, vm2, vm2);
+        add_n(e, vm2, vm2, vm2);
+        zero_extend(e, t, k, v);
+        sub_n(e, vm2, t, vm2);
+
+        /* Pointwise products. r(0) and r(inf) go straight into w. */
+        neg1 = tc_abs(e, um1) ^ tc_abs(e, vm1);
+        neg2 = tc_abs(e, um2) ^ tc_abs(e, vm2);
+
+        memset(w + 2 * k, 0, sizeof(w[0]) * 2 * k);
+        mul_fork(&tasks[0], k, k, u, v, w);
+        mul_fork(&tasks[1], m - 2 * k, n - 2 * k, u + 2 * k, v + 2 * k,
+                 w + 4 * k);
+        mul_fork(&tasks[2], e, e, up1, vp1, r1);
+        mul_fork(&tasks[3], e, e, um1, vm1, rm1);
+        mul(e, e, um2, vm2, rm2);
+        for (i = 3; i >= 0; i--) {
+                mul_join(&tasks[i]);
+        }
+
+        if (neg1) {
+                negate(l, rm1);
+        }
+        if (neg2) {
+                negate(l, rm2);
+        }
+
+        toom3_finish(m + n, k, w, l, r1, rm1, rm2, r);
+
+        scratch_free(up1, size);
+}
+
+/* Square n-place u into 2n-place w as by toom3(). The values at -1 and -2
+   square to the same whatever their sign, so only magnitudes are needed. */
+static void sqr_toom3(int n, const limb_t *u, limb_t *w)
+{
+        int k = (n + 2) / 3;
+        int e = k + 1;
+        int l = 2 * e;
+        size_t size = sizeof(limb_t) * (4 * e + 4 * l);
+        limb_t *up1, *um1, *um2, *t, *r1, *rm1, *rm2, *r;
+        struct mul_task tasks[4];
+        int i;
+
+        assert(2 * k < n);
+
+        up1 = scratch_alloc(size);
+        um1 = up1 + e;
+        um2 = um1 + e;
+        t = um2 + e;
+        r1 = t + e;
+        rm1 = r1 + l;
+        rm2 = rm1 + l;
+        r = rm2 + l;
+
+        zero_extend(e, t, k, u);
+        add_in(e, t, n - 2 * k, u + 2 * k);
+        zero_extend(e, up1, k, u + k);
+        sub_n(e, t, up1, um1);
+        add_n(e, t, up1, up1);
+        zero_extend(e, um2, n - 2 * k, u + 2 * k);
+        add_n(e, um1, um2, um2);
+        add_n(e, um2, um2, um2);
+        zero_extend(e, t, k, u);
+        sub_n(e, um2, t, um2);
+
+        tc_abs(e, um1);
+        tc_abs(e, um2);
+
+        memset(w + 2 * k, 0, sizeof(w[0]) * 2 * k);
+        mul_fork(&tasks[0], k, k, u, u, w);
+        mul_fork(&tasks[1], n - 2 * k, n - 2 * k, u + 2 * k, u + 2 * k,
+                 w + 4 * k);
+        mul_fork(&tasks[2], e, e, up1, up1, r1);
+        mul_fork(&tasks[3], e, e, um1, um1, rm1);
+        sqr(e, um2, rm2);
+        for (i = 3; i >= 0; i--) {
+                mul_join(&tasks[i]);
+        }
+
+        toom3_finish(2 * n, k, w, l, r1, rm1, rm2, r);
+
+        scratch_free(up1, size);
+}
+
+/*
+   Number-theoretic transform multiplication, for the largest operands.
+
+   The operands are split into 32-bit words, which are convolved modulo three
+   primes of the form c * 2**k + 1 below 2**31, and each coefficient is
+   recovered with the Chinese remainder theorem. The primes multiply to more
+   than 2**90, while a coefficient of an NTT_MAX_LENGTH-point product is less
+   than 2**(25 + 64).
+ */
+#ifndef NTT_THRESHOLD
+#define NTT_THRESHOLD (LIMB_BITS == 64 ? 16384 : 2048)
+#endif
+
+#define NTT_MAX_LENGTH (1 << 26)
+
+#define NTT_P1 2013265921u      /* 15 * 2**27 + 1 */
+#define NTT_P2 1811939329u      /* 27 * 2**26 + 1 */
+#define NTT_P3 469762049u       /*  7 * 2**26 + 1 */
+
+struct ntt_prime {
+        uint32_t p;
+        uint32_t p_inv;         /* -1/p mod 2**32, for Montgomery reduction. */
+        uint32_t g;             /* A primitive root modulo p. */
+};
+
+static const struct ntt_prime ntt_primes[] = {
+        {NTT_P1, 0x77ffffffu, 31},
+        {NTT_P2, 0x6bffffffu, 13},
+        {NTT_P3, 0x1bffffffu, 3},
+};
+
+/* Get the i-th 32-bit word of the limbs in u. */
+static uint32_t get_word(const limb_t *u, int i)
+{
+        return (uint32_t)(u[i / LIMB_WORDS] >> (32 * (i % LIMB_WORDS)));
+}
+
+/* Compute a * b / 2**32 mod p, for a < 2**32 and b < p. */
+static uint32_t mont_mul(const struct ntt_prime *pr, uint32_t a, uint32_t b)
+{
+        uint64_t t = (uint64_t)a * b;
+        uint32_t m = (uint32_t)t * pr->p_inv;
+        uint32_t r = (uint32_t)((t + (uint64_t)m * pr->p) >> 32);
+
+        return r >= pr->p ? r - pr->p : r;
+}
+
+/* Compute x**e mod p. Only used for setting up the transforms. */
+static uint32_t pow_mod(uint32_t x, uint32_t e, uint32_t p)
+{
+        uint64_t r = 1, b = x % p;
+
+        while (e) {
+                if (e & 1) {
+                        r = r * b % p;
+                }
+                b = b * b % p;
+                e >>= 1;
+        }
+
+        return (uint32_t)r;
+}
+
+/*
+   Fill the n-place table t with the twiddle factors for an n-point transform
+   in Montgomery form: t[h + j] = w**j * 2**32 mod p for each h = len / 2,
+   where w is a primitive len-th root of unity (or its inverse). t[0] is unused.
+ */
+static void ntt_roots(const struct ntt_prime *pr, int n, bool inverse,
+                      uint32_t *t)
+{
+        uint32_t w, one;
+        int h, j;
+
+        one = (uint32_t)(((uint64_t)1 << 32) % pr->p);
+
+        for (h = 1; h < n; h *= 2) {
+                w = pow_mod(pr->g, (pr->p - 1) / (2 * h), pr->p);
+                if (inverse) {
+                        w = pow_mod(w, pr->p - 2, pr->p);
+                }
+                w = (uint32_t)(((uint64_t)w << 32) % pr->p);
+
+                t[h] = one;
+                for (j = 1; j < h; j++) {
+                        t[h + j] = mont_mul(pr, t[h + j - 1], w);
+                }
+        }
+}
+
+/* Arguments of the transforms and convolutions, for running as pool tasks. */
+struct ntt_task {
+        struct pool_task task;
+        const struct ntt_prime *pr;
+        int n, m, k;
+        const limb_t *u, *v;
+        uint32_t *a, *t;
+        const uint32_t *roots;
+};
+
+static void ntt_forward(const struct ntt_prime *pr, int n, uint32_t *a,
+                        const uint32_t *roots);
+static void ntt_inverse(const struct ntt_prime *pr, int n, uint32_t *a,
+                        const uint32_t *roots);
+
+static void ntt_forward_run(void *arg)
+{
+        struct ntt_task *t = arg;
+
+        ntt_forward(t->pr, t->n, t->a, t->roots);
+}
+
+static void ntt_inverse_run(void *arg)
+{
+        struct ntt_task *t = arg;
+
+        ntt_inverse(t->pr, t->n, t->a, t->roots);
+}
+
+/* Whether an n-point transform is worth splitting between threads. */
+static bool ntt_split(int n)
+{
+        return n / 2 >= PARALLEL_THRESHOLD * LIMB_WORDS && pool_threads() > 1;
+}
+
+/*
+   In-place forward transform of the n-place a, n a power of two. The output
+   is left in bit-reversed order, which ntt_inverse() expects as input.
+
+   After the first pass, the two halves of a transform independently with the
+   same twiddle factors, so large transforms fork one half.
+ */
+static void ntt_forward(const struct ntt_prime *pr, int n, uint32_t *a,
+                        const uint32_t *roots)
+{
+        uint32_t p = pr->p, x, y;
+        struct ntt_task half;
+        int h, i, j;
+
+        if (ntt_split(n)) {
+                h = n / 2;
+                for (j = 0; j < h; j++) {
+                        x = a[j];
+                        y = a[j + h];
+                        a[j] = (x + y >= p ? x + y - p : x + y);
+                        a[j + h] = mont_mul(pr, x + p - y, roots[h + j]);
+                }
+
+                half = (struct ntt_task){.pr = pr, .n = h, .a = a + h,
+                                         .roots = roots};
+                pool_fork(&half.task, ntt_forward_run, &half);
+                ntt_forward(pr, h, a, roots);
+                pool_join(&half.task);
+                return;
+        }
+
+        for (h = n / 2; h >= 1; h /= 2) {
+                for (i = 0; i < n; i += 2 * h) {
+                        for (j = 0; j < h; j++) {
+                                x = a[i + j];
+                                y = a[i + j + h];
+                                a[i + j] = (x + y >= p ? x + y - p : x + y);
+                                a[i + j + h] = mont_mul(pr, x + p - y,
+                                                        roots[h + j]);
+                        }
+                }
+        }
+}
+
+/* In-place inverse of ntt_forward(), without the division by n. Large
+   transforms fork one half before the last pass. */
+static void ntt_inverse(const struct ntt_prime *pr, int n, uint32_t *a,
+                        const uint32_t *roots)
+{
+        uint32_t p = pr->p, x, y;
+        struct ntt_task half;
+        int h, i, j;
+
+        if (ntt_split(n)) {
+                h = n / 2;
+                half = (struct ntt_task){.pr = pr, .n = h, .a = a + h,
+                                         .roots = roots};
+                pool_fork(&half.task, ntt_inverse_run, &half);
+                ntt_inverse(pr, h, a, roots);
+                pool_join(&half.task);
+
+                for (j = 0; j < h; j++) {
+                        x = a[j];
+                        y = mont_mul(pr, a[j + h], roots[h + j]);
+                        a[j] = (x + y >= p ? x + y - p : x + y);
+                        a[j + h] = (x >= y ? x - y : x + p - y);
+                }
+                return;
+        }
+
+        for (h = 1; h < n; h *= 2) {
+                for (i = 0; i < n; i += 2 * h) {
+                        for (j = 0; j < h; j++) {
+                                x = a[i + j];
+                                y = mont_mul(pr, a[i + j + h], roots[h + j]);
+                                a[i + j] = (x + y >= p ? x + y - p : x + y);
+                                a[i + j + h] = (x >= y ? x - y : x + p - y);
+                        }
+                }
+        }
+}
+
+/*
+   Compute the cyclic n-point convolution of the first m words of u and the
+   first k words of v modulo pr->p into r, using t as n places of scratch. A
+   square needs only the one forward transform.
+ */
+static void ntt_convolve(const struct ntt_prime *pr, int n,
+                         int m, const limb_t *u, int k, const limb_t *v,
+                         uint32_t *r, uint32_t *t)
+{
+        uint32_t *roots = scratch_alloc(sizeof(roots[0]) * n);
+        bool square = (u == v && m == k);
+        struct ntt_task other;
+        uint32_t scale;
+        int i;
+
+        for (i = 0; i < m; i++) {
+                r[i] = get_word(u, i) % pr->p;
+        }
+        memset(r + m, 0, sizeof(r[0]) * (n - m));
+        ntt_roots(pr, n, false, roots);
+
+        if (square) {
+                ntt_forward(pr, n, r, roots);
+                t = r;
+        } else {
+                for (i = 0; i < k; i++) {
+                        t[i] = get_word(v, i) % pr->p;
+                }
+                memset(t + k, 0, sizeof(t[0]) * (n - k));
+
+                other = (struct ntt_task){.pr = pr, .n = n, .a = t,
+                                          .roots = roots};
+                pool_fork(&other.task, ntt_forward_run, &other);
+                ntt_forward(pr, n, r, roots);
+                pool_join(&other.task);
+        }
+
+        /* Pointwise products come out divided by 2**32; fold that and the
+           1/n of the inverse transform into a single final scaling. */
+        for (i = 0; i < n; i++) {
+                r[i] = mont_mul(pr, r[i], t[i]);
+        }
+
+        ntt_roots(pr, n, true, roots);
+        ntt_inverse(pr, n, r, roots);
+
+        scale = pow_mod(n, pr->p - 2, pr->p);
+        scale = (uint32_t)((((uint64_t)scale << 32) % pr->p << 32) % pr->p);
+        for (i = 0; i < n; i++) {
+                r[i] = mont_mul(pr, r[i], scale);
+        }
+
+        scratch_free(roots, sizeof(roots[0]) * n);
+}
+
+static void ntt_convolve_run(void *arg)
+{
+        struct ntt_task *t = arg;
+
+        ntt_convolve(t->pr, t->n, t->m, t->u, t->k, t->v, t->a, t->t);
+}
+
+/* Multiply m-place u with n-place v, yielding (m + n)-place w, using NTTs.
+   With several threads, the three primes are done at the same time, each
+   with its own scratch. */
+static void ntt_mul(int m, int n, const limb_t *u, const limb_t *v,
+                    limb_t *w)
+{
+        /* Inverses for Garner's algorithm. */
+        const uint64_t p1_inv_p2 = 1811939320, p1_inv_p3 = 163395495,
+                       p2_inv_p3 = 70464307;
+        const uint64_t p1p2 = (uint64_t)NTT_P1 * NTT_P2;
+        uint64_t x1, x2, x3, a, b, carry;
+        uint32_t *r1, *r2, *r3, *t1, *t2, *t3;
+        struct ntt_task tasks[2];
+        int len, i, scratch;
+
+        /* Work in 32-bit words from here on. */
+        m *= LIMB_WORDS;
+        n *= LIMB_WORDS;
+        assert(m + n <= NTT_MAX_LENGTH);
+
+        for (len = 1; len < m + n; len *= 2) {
+        }
+
+        scratch = pool_threads() > 1 ? 3 : 1;
+        r1 = scratch_alloc(sizeof(r1[0]) * len * (3 + scratch));
+        r2 = r1 + len;
+        r3 = r2 + len;
+        t1 = r3 + len;
+        t2 = t1 + len * (scratch - 1) / 2;
+        t3 = t1 + len * (scratch - 1);
+
+        for (i = 0; i < 2; i++) {
+                tasks[i] = (struct ntt_task){
+                        .pr = &ntt_primes[i], .n = len, .m = m, .u = u,
+                        .k = n, .v = v, .a = i ? r2 : r1, .t = i ? t2 : t1};
+                pool_fork(&tasks[i].task, ntt_convolve_run, &tasks[i]);
+        }
+        ntt_convolve(&ntt_primes[2], len, m, u, n, v, r3, t3);
+        pool_join(&tasks[1].task);
+        pool_join(&tasks[0].task);
+
+        memset(w, 0, sizeof(w[0]) * (m + n) / LIMB_WORDS);
+
+        carry = 0;
+        for (i = 0; i < m + n; i++) {
+                /* Coefficient i is x1 + x2 * p1 + x3 * p1 * p2. */
+                x1 = r1[i];
+                x2 = (r2[i] + NTT_P2 - x1 % NTT_P2) * p1_inv_p2 % NTT_P2;
+                x3 = (r3[i] + NTT_P3 - x1 % NTT_P3) * p1_inv_p3 % NTT_P3;
+                x3 = (x3 + NTT_P3 - x2 % NTT_P3) * p2_inv_p3 % NTT_P3;
+
+                /* Add it to the carry from the previous coefficients, as
+                   ((a >> 32) + b) * 2**32 + (uint32_t)a. */
+                a = x1 + x2 * NTT_P1 + x3 * (uint32_t)p1p2;
+                b = x3 * (p1p2 >> 32);
+
+                carry += (uint32_t)a;
+                w[i / LIMB_WORDS] |=
+                        (limb_t)(uint32_t)carry << (32 * (i % LIMB_WORDS));
+                carry = (carry >> 32) + (a >> 32) + b;
+        }
+
+        assert(carry == 0 && "Product does not fit!");
+
+        scratch_free(r1, sizeof(r1[0]) * len * (3 + scratch));
+}
+
+/*
+   Multiply m-place u with n-place v, yielding (m + n)-place w, choosing the
+   algorithm based on the operand sizes.
+ */
+static void mul(int m, int n, const limb_t *u, const limb_t *v,
+                limb_t *w)
+{
+        limb_t *t;
+        int i, c;
+
+        if (m < n) {
+                mul(n, m, v, u, w);
+                return;
+        }
+
+        assert(m >= n);
+
+        if (u == v && m == n) {
+                sqr(n, u, w);
+                return;
+        }
+
+        if (n < KARATSUBA_THRESHOLD) {
+                algorithm_m(m, n, u, v, w);
+                return;
+        }
+
+        if (m + 1 >= 2 * n) {
+                /* Too unbalanced to split evenly: multiply v by n-place
+                   slices of u and add up the partial products. */
+                t = scratch_alloc(sizeof(t[0]) * 2 * n);
+                memset(w, 0, sizeof(w[0]) * (m + n));
+                for (i = 0; i < m; i += n) {
+                        c = (m - i < n ? m - i : n);
+                        mul(c, n, u + i, v, t);
+                        add_in(m + n - i, w + i, c + n, t);
+                }
+                scratch_free(t, sizeof(t[0]) * 2 * n);
+                return;
+        }
+
+        if (n >= NTT_THRESHOLD && (m + n) * LIMB_WORDS <= NTT_MAX_LENGTH) {
+                ntt_mul(m, n, u, v, w);
+                return;
+        }
+
+        if (n < TOOM3_THRESHOLD || 2 * ((m + 2) / 3) >= n) {
+                karatsuba(m, n, u, v, w);
+                return;
+        }
+
+        toom3(m, n, u, v, w);
+}
+
+/* Square n-place u, yielding 2n-place w, the way mul() multiplies. */
+static void sqr(int n, const limb_t *u, limb_t *w)
+{
+        if (n < SQR_KARATSUBA_THRESHOLD) {
+                algorithm_sqr(n, u, w);
+                return;
+        }
+
+        if (n >= NTT_THRESHOLD && 2 * n * LIMB_WORDS <= NTT_MAX_LENGTH) {
+                ntt_mul(n, n, u, u, w);
+                return;
+        }
+
+        if (n < SQR_TOOM3_THRESHOLD) {
+                sqr_karatsuba(n, u, w);
+                return;
+        }
+
+        sqr_toom3(n, u, w);
+}
+
+/* Divide (u_hi:u_lo) by v, setting q and r to the quotient and remainder. */
+static void div_2_by_1(limb_t u_hi, limb_t u_lo, limb_t v,
+                       limb_t *q, limb_t *r)
+{
+        assert(v > 0 && "Division by zero!");
+        assert(u_hi < v && "Division overflow!");
+
+#if LIMB_BITS == 64 && defined(__x86_64__) && defined(__GNUC__)
+        /* A 128-bit division would go through a library call. */
+        __asm__("divq %4" : "=a"(*q), "=d"(*r) : "a"(u_lo), "d"(u_hi), "rm"(v));
+#else
+        dlimb_t u = ((dlimb_t)u_hi << LIMB_BITS) | u_lo;
+
+        *q = (limb_t)(u / v);
+        *r = (limb_t)(u % v);
+#endif
+}
+
+/* Count leading zeros in x. x must not be zero. */
+static int leading_zeros(limb_t x)
+{
+        assert(x != 0);
+
+#if defined(__GNUC__)
+        return __builtin_clzll(x) - (64 - LIMB_BITS);
+#else
+        int n = 0;
+
+        while (x <= LIMB_MAX / 2) {
+                x <<= 1;
+                n++;
+        }
+
+        return n;
+#endif
+}
+
+/*
+   Get the reciprocal floor((B**2 - 1) / v) - B of v, where B = 2**LIMB_BITS
+   and v has its top bit set, for div_2_by_1_preinv().
+ */
+static limb_t limb_reciprocal(limb_t v)
+{
+        limb_t q, r;
+
+        assert(v > LIMB_MAX / 2 && "v must be normalized!");
+
+        div_2_by_1(~v, LIMB_MAX, v, &q, &r);
+
+        return q;
+}
+
+/*
+   Divide as div_2_by_1() does, for v with its top bit set and inv its
+   reciprocal, using multiplications instead of a division. This is
+   algorithm 4 of Moller and Granlund, "Improved division by invariant
+   integers" (2011).
+ */
+static void div_2_by_1_preinv(limb_t u_hi, limb_t u_lo, limb_t v, limb_t inv,
+                              limb_t *q, limb_t *r)
+{
+        dlimb_t p;
+        limb_t q_hi, q_lo, k;
+
+        assert(u_hi < v && "Division overflow!");
+
+        p = (dlimb_t)inv * u_hi + (((dlimb_t)u_hi << LIMB_BITS) | u_lo);
+        q_hi = (limb_t)(p >> LIMB_BITS) + 1;
+        q_lo = (limb_t)p;
+
+        k = u_lo - q_hi * v;
+        if (k > q_lo) {
+                q_hi--;
+                k += v;
+        }
+        if (k >= v) {
+                q_hi++;
+                k -= v;
+        }
+
+        *q = q_hi;
+        *r = k;
+}
+
+/*
+   Divide n-place u by v, yielding n-place quotient q and scalar remainder r.
+   q may be u. u is divided as u * 2**shift by the normalized v * 2**shift, so
+   that the reciprocal applies, with the shifted limbs formed as they are used.
+ */
+static void short_division(int n, const limb_t *u, limb_t v,
+                           limb_t *q, limb_t *r)
+{
+        limb_t inv, k;
+        int shift, i;
+
+        assert(v > 0 && "Division by zero!");
+        assert(n > 0 && "Dividing empty number!");
+
+        shift = leading_zeros(v);
+        v <<= shift;
+        inv = limb_reciprocal(v);
+
+        if (shift == 0) {
+                k = 0;
+                for (i = n - 1; i >= 0; i--) {
+                        div_2_by_1_preinv(k, u[i], v, inv, &q[i], &k);
+                }
+                *r = k;
+                return;
+        }
+
+        k = u[n - 1] >> (LIMB_BITS - shift);
+        for (i = n - 1; i > 0; i--) {
+                div_2_by_1_preinv(k, (u[i] << shift) |
+                                  (u[i - 1] >> (LIMB_BITS - shift)),
+                                  v, inv, &q[i], &k);
+        }
+        div_2_by_1_preinv(k, u[0] << shift, v, inv, &q[0], &k);
+        *r = k >> shift;
+}
+
+/* Shift n-place u m positions to the left. */
+static void shift_left(int n, limb_t *u, int m)
+{
+        limb_t k, t;
+        int i;
+
+        assert(m > 0);
+        assert(m < LIMB_BITS);
+
+        k = 0;
+        for (i = 0; i < n; i++) {
+                t = u[i] >> (LIMB_BITS - m);
+                u[i] = (u[i] << m) | k;
+                k = t;
+        }
+
+        assert(k == 0 && "Leftover carry!");
+}
+
+/* Store n-place u shifted left by s bits into the n + s / LIMB_BITS + 1
+   places of w, and return that length. w may be u. */
+static int shift_up(int n, const limb_t *u, uint64_t s, limb_t *w)
+{
+        int q = (int)(s / LIMB_BITS), r = (int)(s % LIMB_BITS), i;
+
+        /* From the top down, so that the shift can be done in place. */
+        if (r == 0) {
+                memmove(w + q, u, sizeof(w[0]) * n);
+                w[q + n] = 0;
+        } else {
+                w[q + n] = u[n - 1] >> (LIMB_BITS - r);
+                for (i = n - 1; i > 0; i--) {
+                        w[q + i] = (u[i] << r) | (u[i - 1] >> (LIMB_BITS - r));
+                }
+                w[q] = u[0] << r;
+        }
+        memset(w, 0, sizeof(w[0]) * q);
+
+        return q + n + 1;
+}
+
+/* Store n-place u shifted right by s bits, where s < LIMB_BITS * n, into the
+   n - s / LIMB_BITS places of w, and return that length. w may be u. */
+static int shift_down(int n, const limb_t *u, uint64_t s, limb_t *w)
+{
+        int q = (int)(s / LIMB_BITS), r = (int)(s % LIMB_BITS), i;
+
+        assert(q < n);
+
+        /* From the bottom up, so that the shift can be done in place. */
+        if (r == 0) {
+                memmove(w, u + q, sizeof(w[0]) * (n - q));
+        } else {
+                for (i = 0; i < n - q - 1; i++) {
+                        w[i] = (u[q + i] >> r) |
+                               (u[q + i + 1] << (LIMB_BITS - r));
+                }
+                w[n - q - 1] = u[n - 1] >> r;
+        }
+
+        return n - q;
+}
+
+/* Shift n-place u m positions to the right. */
+static void shift_right(int n, limb_t *u, int m)
+{
+        limb_t k, t;
+        int i;
+
+        assert(m > 0);
+        assert(m < LIMB_BITS);
+
+        k = 0;
+        for (i = n - 1; i >= 0; i--) {
+                t = u[i] << (LIMB_BITS - m);
+                u[i] = (u[i] >> m) | k;
+                k = t;
+        }
+
+        assert(k == 0 && "Leftover carry!");
+}
+
+/*
+   Divide (m + n)-place u by n-place v, yielding (m + 1)-place quotient q and
+   n-place remainder u. u must have room for an (m + n + 1)th element.
+ */
+static void algorithm_d(int m, int n, limb_t *u, limb_t *v, limb_t *q)
+{
+        int shift;
+        int j, i;
+        limb_t qhat, rhat, k, d;
+        bool overflow;
+        dlimb_t p;
+
+        assert(n > 0 && "v must be greater than zero!");
+        assert(v[n - 1] != 0 && "v must not have leading zeros!");
+
+        if (n == 1) {
+                short_division(m + n, u, v[0], q, &u[0]);
+                return;
+        }
+
+        /* Normalize. */
+        u[m + n] = 0;
+        shift = leading_zeros(v[n - 1]);
+        if (shift) {
+                shift_left(n, v, shift);
+                shift_left(m + n + 1, u, shift);
+        }
+
+        for (j = m; j >= 0; j--) {
+                /* Calculate qhat. Normalization guarantees that
+                   u[j + n] <= v[n - 1]; in case of equality, start from the
+                   largest possible digit. */
+                if (u[j + n] == v[n - 1]) {
+                        qhat = LIMB_MAX;
+                        rhat = u[j + n - 1] + v[n - 1];
+                        overflow = (rhat < v[n - 1]);
+                } else {
+                        div_2_by_1(u[j + n], u[j + n - 1], v[n - 1],
+                                   &qhat, &rhat);
+                        overflow = false;
+                }
+
+                assert(n >= 2);
+                while (!overflow &&
+                       (dlimb_t)qhat * v[n - 2] >
+                       (((dlimb_t)rhat << LIMB_BITS) | u[j + n - 2])) {
+                        qhat--;
+                        rhat += v[n - 1];
+                        overflow = (rhat < v[n - 1]);
+                }
+
+                /* Multiply and subtract. */
+                k = 0;
+                for (i = 0; i < n; i++) {
+                        p = (dlimb_t)qhat * v[i] + k;
+                        k = (limb_t)(p >> LIMB_BITS);
+
+                        d = u[j + i] - (limb_t)p;
+                        k += (d > u[j + i]);
+                        u[j + i] = d;
+                }
+                d = u[j + n] - k;
+                k = (d > u[j + n]);
+                u[j + n] = d;
+
+                /* Test remainder. */
+                q[j] = qhat;
+                if (k != 0) {
+                        /* Add back. */
+                        q[j]--;
+                        u[j + n] += add_n(n, u + j, v, u + j);
+                }
+        }
+
+        /* Unnormalize. */
+        if (shift) {
+                shift_right(n, u, shift);
+        }
+}
+
+/*
+   Divide (m + n)-place u with n-place v, yielding (m + 1)-place quotient q and
+   n-place remainder r.
+ */
+static void algorithm_d_wrapper(int m, int n, const limb_t *u,
+                                const limb_t *v, limb_t *q, limb_t *r)
+{
+        /* algorithm_d() works in place, so make copies to normalize. Also
+           extend the dividend one place, as that is required for the
+           normalization step. */
+
+        size_t size = sizeof(limb_t) * (m + n + 1 + n);
+        limb_t *uu, *vv;
+
+        assert(n > 0 && "Division by zero!");
+        assert(v[n - 1] != 0 && "v has leading zero!");
+
+        uu = scratch_alloc(size);
+        vv = uu + m + n + 1;
+
+        memcpy(uu, u, sizeof(uu[0]) * (m + n));
+        memcpy(vv, v, sizeof(vv[0]) * n);
+
+        algorithm_d(m, n, uu, vv, q);
+
+        memcpy(r, uu, sizeof(r[0]) * n);
+
+        scratch_free(uu, size);
+}
+
+/*
+   Sizes, in limbs, for choosing the division algorithm: below
+   DIV_DC_THRESHOLD use algorithm_d, from DIV_NEWTON_THRESHOLD on use Newton
+   iteration, and in between Burnikel-Ziegler recursive division.
+ */
+#ifndef DIV_DC_THRESHOLD
+#define DIV_DC_THRESHOLD 40
+#endif
+
+#ifndef DIV_NEWTON_THRESHOLD
+#define DIV_NEWTON_THRESHOLD (LIMB_BITS == 64 ? 50000 : 100000)
+#endif
+
+#if DIV_DC_THRESHOLD < 4
+#error "DIV_DC_THRESHOLD must be at least 4."
+#endif
+
+static const limb_t limb_one = 1;
+
+/* Strip leading zeros from n-place u, returning the new size. */
+static int normalized_length(int n, const limb_t *u)
+{
+        while (n > 0 && u[n - 1] == 0) {
+                n--;
+        }
+
+        return n;
+}
+
+static void bz_div_2n_1n(int n, const limb_t *a, const limb_t *b,
+                         limb_t *q, limb_t *r);
+
+/*
+   Divide 3h-place a by 2h-place b, yielding h-place quotient q and 2h-place
+   remainder r. b must be normalized (its top bit set), and a < b * B**h,
+   where B = 2**LIMB_BITS.
+
+   The quotient is estimated from the top two thirds of a and the top half
+   of b, which is off by at most two when b is normalized.
+ */
+static void bz_div_3h_2h(int h, const limb_t *a, const limb_t *b,
+                         limb_t *q, limb_t *r)
+{
+        size_t size = sizeof(limb_t) * (2 * h + 2 + 2 * h);
+        limb_t *t, *d;
+        int i;
+
+        /* t holds the remainder as a (2h + 2)-place two's complement. */
+        t = scratch_alloc(size);
+        d = t + 2 * h + 2;
+
+        if (cmp(h, a + 2 * h, h, b + h) < 0) {
+                /* (q, t1) = (a1 * B**h + a2) / b1 */
+                bz_div_2n_1n(h, a + h, b + h, q, t + h);
+                t[2 * h] = 0;
+        } else {
+                /* a1 == b1, so take q = B**h - 1 and
+                   t1 = a1 * B**h + a2 - q * b1 = a2 + b1. */
+                for (i = 0; i < h; i++) {
+                        q[i] = LIMB_MAX;
+                }
+                t[2 * h] = add_n(h, a + h, b + h, t + h);
+        }
+
+        /* t = t1 * B**h + a3 - q * b2 */
+        memcpy(t, a, sizeof(t[0]) * h);
+        t[2 * h + 1] = 0;
+        mul(h, h, q, b, d);
+        sub_in(2 * h + 2, t, 2 * h, d);
+
+        while (t[2 * h + 1] >> (LIMB_BITS - 1)) {
+                add_in(2 * h + 2, t, 2 * h, b);
+                sub_in(h, q, 1, &limb_one);
+        }
+
+        assert(t[2 * h] == 0 && t[2 * h + 1] == 0);
+        memcpy(r, t, sizeof(r[0]) * 2 * h);
+
+        scratch_free(t, size);
+}
+
+/*
+   Divide 2n-place a by n-place b, yielding n-place quotient q and n-place
+   remainder r. b must be normalized, and a < b * B**n.
+ */
+static void bz_div_2n_1n(int n, const limb_t *a, const limb_t *b,
+                         limb_t *q, limb_t *r)
+{
+        size_t size;
+        limb_t *t;
+        int h;
+
+        if (n % 2 != 0 || n < DIV_DC_THRESHOLD) {
+                /* Leading zeros in a make for a shorter quotient. */
+                h = normalized_length(2 * n, a) - n;
+                memset(q, 0, sizeof(q[0]) * n);
+                if (h < 0) {
+                        memcpy(r, a, sizeof(r[0]) * n);
+                        return;
+                }
+
+                size = sizeof(limb_t) * (h + 1);
+                t = scratch_alloc(size);
+
+                algorithm_d_wrapper(h, n, a, b, t, r);
+                memcpy(q, t, sizeof(q[0]) * (h < n ? h + 1 : n));
+
+                scratch_free(t, size);
+                return;
+        }
+
+        h = n / 2;
+        size = sizeof(limb_t) * 3 * h;
+        t = scratch_alloc(size);
+
+        /* Divide the top three quarters of a, then bring down the last
+           quarter after the remainder and divide again. */
+        memcpy(t, a, sizeof(t[0]) * h);
+        bz_div_3h_2h(h, a + h, b, q + h, t + h);
+        bz_div_3h_2h(h, t, b, q, r);
+
+        scratch_free(t, size);
+}
+
+/* Set the (2n + 2)-place two's complement e = B**(2n) - 1 - v * x for
+   n-place v and (n + 1)-place x, using p as 2n + 2 places of scratch. */
+static void reciprocal_error(int n, const limb_t *v, const limb_t *x,
+                             limb_t *e, limb_t *p)
+{
+        limb_t j;
+        int i;
+
+        /* The top place of x is at most 2, so it is added in separately to
+           keep the product n by n. */
+        assert(x[n] <= 2);
+        mul(n, n, v, x, p);
+        p[2 * n] = p[2 * n + 1] = 0;
+        for (j = 0; j < x[n]; j++) {
+                add_in(n + 2, p + n, n, v);
+        }
+        for (i = 0; i < 2 * n; i++) {
+                e[i] = LIMB_MAX;
+        }
+        e[2 * n] = e[2 * n + 1] = 0;
+        sub_n(2 * n + 2, e, p, e);
+}
+
+/*
+   Compute an (n + 1)-place approximation x of floor((B**(2n) - 1) / v) for
+   normalized n-place v, off by at most a few units.
+
+   The top h = n / 2 + 1 places of v give an approximation xh of about half
+   the precision, from which one Newton step
+
+     x = x0 + x0 * (B**(2n) - v * x0) / B**(2n),   x0 = xh * B**(n - h)
+
+   gives full precision. The extra place in h keeps the error of xh from
+   being squared into the result.
+ */
+static void reciprocal_approx(int n, const limb_t *v, limb_t *x)
+{
+        int h = n / 2 + 1, l = n - h, e_len, c_len, i;
+        size_t size;
+        limb_t *xh, *p, *e, *c;
+        bool negative;
+
+        if (n < DIV_DC_THRESHOLD) {
+                size = sizeof(limb_t) * (2 * n + n);
+                p = scratch_alloc(size);
+                for (i = 0; i < 2 * n; i++) {
+                        p[i] = LIMB_MAX;
+                }
+
+                algorithm_d_wrapper(n, n, p, v, x, p + 2 * n);
+
+                scratch_free(p, size);
+                return;
+        }
+
+        size = sizeof(limb_t) * ((h + 1) + (2 * n + 2) * 2 + (h + n + 3));
+        xh = scratch_alloc(size);
+        p = xh + h + 1;
+        e = p + 2 * n + 2;
+        c = e + 2 * n + 2;
+
+        reciprocal_approx(h, v + l, xh);
+
+        memset(x, 0, sizeof(x[0]) * l);
+        memcpy(x + l, xh, sizeof(x[0]) * (h + 1));
+
+        reciprocal_error(n, v, x, e, p);
+        negative = tc_abs(2 * n + 2, e);
+
+        /* x = x0 +- xh * (|e| / B**n) / B**h. Dropping the low places of e
+           only costs a few units in the last place. */
+        e_len = normalized_length(n + 2, e + n);
+        if (e_len > 0) {
+                mul(h + 1, e_len, xh, e + n, c);
+                c_len = normalized_length(h + 1 + e_len, c);
+                if (c_len > h) {
+                        assert(c_len - h <= n + 1);
+                        if (negative) {
+                                sub_in(n + 1, x, c_len - h, c + h);
+                        } else {
+                                add_in(n + 1, x, c_len - h, c + h);
+                        }
+                }
+        }
+
+        scratch_free(xh, size);
+}
+
+/* Compute the (n + 1)-place x = floor((B**(2n) - 1) / v) for normalized
+   n-place v. */
+static void reciprocal(int n, const limb_t *v, limb_t *x)
+{
+        size_t size = sizeof(limb_t) * (2 * n + 2) * 2;
+        limb_t *e;
+
+        reciprocal_approx(n, v, x);
+
+        /* Correct x until 0 <= B**(2n) - 1 - v * x < v. */
+        e = scratch_alloc(size);
+        reciprocal_error(n, v, x, e, e + 2 * n + 2);
+
+        while (e[2 * n + 1] >> (LIMB_BITS - 1)) {
+                add_in(2 * n + 2, e, n, v);
+                sub_in(n + 1, x, 1, &limb_one);
+        }
+        while (cmp(normalized_length(2 * n + 2, e), e, n, v) >= 0) {
+                sub_in(2 * n + 2, e, n, v);
+                add_in(n + 1, x, 1, &limb_one);
+        }
+
+        scratch_free(e, size);
+}
+
+/*
+   Divide 2n-place a by n-place b, yielding n-place quotient q and n-place
+   remainder r, given x = reciprocal(b). b must be normalized, and
+   a < b * B**n.
+ */
+static void barrett_div(int n, const limb_t *a, const limb_t *b,
+                        const limb_t *x, limb_t *q, limb_t *r)
+{
+        size_t size = sizeof(limb_t) * ((2 * n + 1) + 2 * n + (n + 1));
+        limb_t *t, *p, *rr, j;
+
+        t = scratch_alloc(size);
+        p = t + 2 * n + 1;
+        rr = p + 2 * n;
+
+        /* q = floor(floor(a / B**n) * x / B**n), which is at most four less
+           than the real quotient. x[n] is 1 for exact x. */
+        mul(n, n, a + n, x, t);
+        t[2 * n] = 0;
+        for (j = 0; j < x[n]; j++) {
+                add_in(n + 1, t + n, n, a + n);
+        }
+        assert(t[2 * n] == 0);
+        memcpy(q, t + n, sizeof(q[0]) * n);
+
+        /* The remainder is less than 5b < B**(n + 1), so only the low
+           n + 1 places of a - q * b are needed. */
+        mul(n, n, q, b, p);
+        sub_n(n + 1, a, p, rr);
+
+        while (rr[n] != 0 || cmp(n, rr, n, b) >= 0) {
+                sub_in(n + 1, rr, n, b);
+                add_in(n, q, 1, &limb_one);
+        }
+
+        memcpy(r, rr, sizeof(r[0]) * n);
+
+        scratch_free(t, size);
+}
+
+/*
+   Divide (m + n)-place u by n-place v, yielding (m + 1)-place quotient q and
+   n-place remainder r, with Newton or Burnikel-Ziegler division.
+
+   v is scaled by a power of two to normalize it and, for Burnikel-Ziegler,
+   by a power of B so that its length s halves evenly down to below
+   DIV_DC_THRESHOLD. u is scaled the same way and divided like long division
+   with s-place digits, the top part getting whatever is left over.
+ */
+static void divide_blocks(int m, int n, const limb_t *u, const limb_t *v,
+                          limb_t *q, limb_t *r, bool newton)
+{
+        int s, k, pad, shift, blocks, top, i;
+        limb_t *vv, *uu, *rr, *a, *x, *t;
+        size_t size;
+
+        if (newton) {
+                s = n;
+        } else {
+                for (k = 0; (DIV_DC_THRESHOLD << k) < n; k++) {
+                }
+                s = ((n + (1 << k) - 1) >> k) << k;
+        }
+        pad = s - n;
+        shift = leading_zeros(v[n - 1]);
+
+        /* The scaled u has m + s + 1 places: s + top for the leading part,
+           whose quotient has top places, and then full blocks. */
+        blocks = (m + 1) / s;
+        top = (m + 1) % s;
+
+        size = sizeof(limb_t) * (s + (m + s + 1) + s + 2 * s + 2 * (s + 1));
+        vv = scratch_alloc(size);
+        uu = vv + s;
+        rr = uu + m + s + 1;
+        a = rr + s;
+        x = a + 2 * s;
+        t = x + s + 1;
+
+        memset(vv, 0, sizeof(vv[0]) * pad);
+        memcpy(vv + pad, v, sizeof(vv[0]) * n);
+        memset(uu, 0, sizeof(uu[0]) * pad);
+        memcpy(uu + pad, u, sizeof(uu[0]) * (m + n));
+        uu[m + s] = 0;
+        if (shift) {
+                shift_left(s, vv, shift);
+                shift_left(m + s + 1, uu, shift);
+        }
+
+        if (newton) {
+                reciprocal(s, vv, x);
+        }
+
+        if (top == 0) {
+                memcpy(rr, uu + blocks * s, sizeof(rr[0]) * s);
+        } else if (top < DIV_DC_THRESHOLD) {
+                algorithm_d_wrapper(top, s, uu + blocks * s, vv, t, rr);
+                memcpy(q + blocks * s, t, sizeof(q[0]) * top);
+        } else {
+                memcpy(a, uu + blocks * s, sizeof(a[0]) * (s + top));
+                memset(a + s + top, 0, sizeof(a[0]) * (s - top));
+                if (newton) {
+                        barrett_div(s, a, vv, x, t, rr);
+                } else {
+                        bz_div_2n_1n(s, a, vv, t, rr);
+                }
+                memcpy(q + blocks * s, t, sizeof(q[0]) * top);
+        }
+
+        for (i = blocks - 1; i >= 0; i--) {
+                memcpy(a, uu + i * s, sizeof(a[0]) * s);
+                memcpy(a + s, rr, sizeof(a[0]) * s);
+                if (newton) {
+                        barrett_div(s, a, vv, x, q + i * s, rr);
+                } else {
+                        bz_div_2n_1n(s, a, vv, q + i * s, rr);
+                }
+        }
+
+        /* Undo the scaling of the remainder. */
+        if (shift) {
+                shift_right(s, rr, shift);
+        }
+        memcpy(r, rr + pad, sizeof(r[0]) * n);
+
+        scratch_free(vv, size);
+}
+
+static void divide(int m, int n, const limb_t *u, const limb_t *v,
+                   limb_t *q, limb_t *r);
+
+/*
+   Divide (m + n)-place u by n-place v, yielding (m + 1)-place quotient q and
+   n-place remainder r, for v much longer than the quotient.
+
+   Dropping the low n - m - 2 places of u and v leaves a balanced division
+   whose quotient is at most one too large, which the remainder shows.
+ */
+static void divide_truncated(int m, int n, const limb_t *u, const limb_t *v,
+                             limb_t *q, limb_t *r)
+{
+        int k = n - m - 2;
+        size_t size = sizeof(limb_t) * ((m + 2) + (m + 1 + n));
+        limb_t *t, *p;
+
+        t = scratch_alloc(size);
+        p = t + m + 2;
+
+        divide(m, m + 2, u + k, v + k, q, t);
+
+        /* r = u - q * v, which is more than -v. */
+        mul(m + 1, n, q, v, p);
+        sub_n(n + 1, u, p, p);
+        if (p[n] != 0) {
+                add_in(n + 1, p, n, v);
+                sub_in(m + 1, q, 1, &limb_one);
+        }
+        assert(p[n] == 0);
+        memcpy(r, p, sizeof(r[0]) * n);
+
+        scratch_free(t, size);
+}
+
+/*
+   Divide (m + n)-place u by n-place v, yielding (m + 1)-place quotient q and
+   n-place remainder r, choosing the algorithm based on the operand sizes.
+ */
+static void divide(int m, int n, const limb_t *u, const limb_t *v,
+                   limb_t *q, limb_t *r)
+{
+        if (n == 1) {
+                short_division(m + 1, u, v[0], q, r);
+        } else if (m < DIV_DC_THRESHOLD || n < DIV_DC_THRESHOLD) {
+                algorithm_d_wrapper(m, n, u, v, q, r);
+        } else if (n > 2 * m + 2) {
+                divide_truncated(m, n, u, v, q, r);
+        } else {
+                divide_blocks(m, n, u, v, q, r,
+                              n >= DIV_NEWTON_THRESHOLD &&
+                              m >= DIV_NEWTON_THRESHOLD);
+        }
+}
+
+/* Multiply m-place integer u by x and add y to it; set m to the new size. */
+static void multiply_add(limb_t *u, int *m, limb_t x, limb_t y)
+{
+        int i;
+        limb_t k;
+        dlimb_t t;
+
+        k = y;
+
+        for (i = 0; i < *m; i++) {
+                t = (dlimb_t)u[i] * x + k;
+                u[i] = (limb_t)t;
+                k = (limb_t)(t >> LIMB_BITS);
+        }
+
+        if (k) {
+                u[*m] = k;
+                (*m)++;
+        }
+}
+
+/* Convert n-character decimal string str into integer u. This takes time
+   quadratic in n. */
+static void from_string_basecase(int n, const char *str, int *u_len,
+                                 limb_t *u)
+{
+        limb_t chunk, scale;
+        int i;
+
+        *u_len = 0;
+        chunk = 0;
+        scale = 1;
+
+        /* Process the string in chunks of up to DEC_DIGITS characters, as
+           10**DEC_DIGITS is the largest power of 10 that fits in a limb. */
+
+        for (i = 1; i <= n; i++) {
+                assert(*str >= '0' && *str <= '9');
+                chunk = chunk * 10 + *str++ - '0';
+                scale *= 10;
+
+                if (i % DEC_DIGITS == 0 || i == n) {
+                        multiply_add(u, u_len, scale, chunk);
+                        chunk = 0;
+                        scale = 1;
+                }
+        }
+}
+
+/*
+   Powers of ten for radix conversion: pow10_cache[k] holds
+   10**(DEC_DIGITS * 2**k), computed by repeated squaring when first needed
+   and kept for the lifetime of the program. Since 10**e = 2**e * 5**e, the
+   larger powers end in zero limbs, which division can skip.
+
+   Threads may race to fill in an entry; the first one to publish its power
+   wins and the others discard theirs.
+ */
+struct pow10 {
+        int length;
+        int zeros;              /* Number of least significant zero limbs. */
+        limb_t *data;
+};
+
+static struct pow10 *_Atomic pow10_cache[32];
+
+/* Get 10**(DEC_DIGITS * 2**k). */
+static const struct pow10 *pow10_get(int k)
+{
+        struct pow10 *p, *prev, *expected;
+        int i;
+
+        assert(k < (int)(sizeof(pow10_cache) / sizeof(pow10_cache[0])));
+
+        p = atomic_load_explicit(&pow10_cache[k], memory_order_acquire);
+        if (p != NULL) {
+                return p;
+        }
+
+        for (i = 0; i <= k; i++) {
+                if (atomic_load_explicit(&pow10_cache[i],
+                                         memory_order_acquire) != NULL) {
+                        continue;
+                }
+
+                p = xmalloc(sizeof(*p));
+                if (i == 0) {
+                        p->length = 1;
+                        p->data = xmalloc(sizeof(limb_t));
+                        p->data[0] = DEC_BASE;
+                } else {
+                        prev = atomic_load_explicit(&pow10_cache[i - 1],
+                                                    memory_order_acquire);
+                        p->length = prev->length * 2;
+                        p->data = xmalloc(sizeof(limb_t) * p->length);
+                        mul(prev->length, prev->length, prev->data,
+                            prev->data, p->data);
+                        while (p->data[p->length - 1] == 0) {
+                                p->length--;
+                        }
+                }
+
+                for (p->zeros = 0; p->data[p->zeros] == 0; p->zeros++) {
+                }
+
+                expected = NULL;
+                if (!atomic_compare_exchange_strong_explicit(
+                            &pow10_cache[i], &expected, p,
+                            memory_order_acq_rel, memory_order_acquire)) {
+                        free(p->data);
+                        free(p);
+                }
+        }
+
+        return atomic_load_explicit(&pow10_cache[k], memory_order_acquire);
+}
+
+/*
+   Divide n-place u by the power p, yielding (n - p->length + 1)-place
+   quotient q and p->length-place remainder r. n >= p->length.
+ */
+static void pow10_divrem(int n, const limb_t *u, const struct pow10 *p,
+                         limb_t *q, limb_t *r)
+{
+        int z = p->zeros;
+
+        assert(n >= p->length);
+
+        /* The low zero limbs of p pass u straight through to r. */
+        divide(n - p->length, p->length - z, u + z, p->data + z, q, r + z);
+        memcpy(r, u, sizeof(r[0]) * z);
+}
+
+/* Count trailing zeros in x. x must not be zero. */
+static int trailing_zeros(limb_t x)
+{
+        int n;
+
+        assert(x != 0);
+
+        n = 0;
+        while ((x & 1) == 0) {
+                x >>= 1;
+                n++;
+        }
+
+        return n;
+}
+
+/* Get the number of significant bits in n-place u, whose top limb is not
+   zero. */
+static uint64_t bit_length(int n, const limb_t *u)
+{
+        return (uint64_t)n * LIMB_BITS - leading_zeros(u[n - 1]);
+}
+
+/*
+   Powers. Small odd bases b < POW_CACHE_BASES keep their repeated squares
+   b**(2**i) here while they have at most POW_CACHE_LIMBS limbs, filled in as
+   pow10_cache is, so that later powers of the same base only multiply.
+ */
+#ifndef POW_CACHE_BASES
+#define POW_CACHE_BASES 64
+#endif
+
+#ifndef POW_CACHE_LIMBS
+#define POW_CACHE_LIMBS 4096
+#endif
+
+struct power {
+        int length;
+        limb_t *data;
+};
+
+static struct power *_Atomic pow_cache[POW_CACHE_BASES / 2][32];
+
+/* Get b**(2**k) for odd b < POW_CACHE_BASES. */
+static const struct power *pow_cache_get(limb_t b, int k)
+{
+        struct power *_Atomic *cache = pow_cache[b / 2];
+        struct power *p, *prev, *expected;
+        int i;
+
+        assert(b % 2 == 1 && b < POW_CACHE_BASES && k < 32);
+
+        p = atomic_load_explicit(&cache[k], memory_order_acquire);
+        if (p != NULL) {
+                return p;
+        }
+
+        for (i = 0; i <= k; i++) {
+                if (atomic_load_explicit(&cache[i], memory_order_acquire) !=
+                    NULL) {
+                        continue;
+                }
+
+                p = xmalloc(sizeof(*p));
+                if (i == 0) {
+                        p->length = 1;
+                        p->data = xmalloc(sizeof(limb_t));
+                        p->data[0] = b;
+                } else {
+                        prev = atomic_load_explicit(&cache[i - 1],
+                                                    memory_order_acquire);
+                        p->length = prev->length * 2;
+                        p->data = xmalloc(sizeof(limb_t) * p->length);
+                        sqr(prev->length, prev->data, p->data);
+                        while (p->data[p->length - 1] == 0) {
+                                p->length--;
+                        }
+                }
+
+                expected = NULL;
+                if (!atomic_compare_exchange_strong_explicit(
+                            &cache[i], &expected, p,
+                            memory_order_acq_rel, memory_order_acquire)) {
+                        free(p->data);
+                        free(p);
+                }
+        }
+
+        return atomic_load_explicit(&cache[k], memory_order_acquire);
+}
+
+/* Replace *x_len-place *x by its product with v_len-place v, formed in the
+   buffer *t, which then takes the place of *x. */
+static void power_mul(limb_t **x, int *x_len, int v_len, const limb_t *v,
+                      limb_t **t)
+{
+        limb_t *y = *t;
+
+        mul(*x_len, v_len, *x, v, y);
+        *x_len = normalized_length(*x_len + v_len, y);
+        *t = *x;
+        *x = y;
+}
+
+/* Compute b**e into *x as the product of the cached b**(2**i) for the bits-bit
+   e, using *t as for power_mul(), and return the length. */
+static int power_cached(limb_t b, uint64_t e, int bits, limb_t **x,
+                        limb_t **t)
+{
+        const struct power *c;
+        int i, len = 0;
+
+        for (i = 0; i < bits; i++) {
+                if ((e >> i & 1) == 0) {
+                        continue;
+                }
+
+                c = pow_cache_get(b, i);
+                if (len == 0) {
+                        memcpy(*x, c->data, sizeof(c->data[0]) * c->length);
+                        len = c->length;
+                } else {
+                        power_mul(x, &len, c->length, c->data, t);
+                }
+        }
+
+        return len;
+}
+
+/*
+   Compute u**e into *x for n-place u and the bits-bit e, using *t as for
+   power_mul(), and return the length. e is scanned from the top in windows
+   of up to k bits that end in a one, each costing as many squarings and one
+   multiplication by a precomputed odd power u, u**3, ..., u**(2**k - 1)
+   (sliding-window exponentiation). As e has at most 64 bits, k = 3 at most
+   minimizes the number of multiplications.
+ */
+static int power_window(int n, const limb_t *u, uint64_t e, int bits,
+                        limb_t **x, limb_t **t)
+{
+        int k = bits < 12 ? 1 : bits < 24 ? 2 : 3;
+        int i, j, l, len = 0, sq_len, odd[4];
+        size_t size = sizeof(limb_t) * n * ((1 << (2 * k - 2)) + 2);
+        const limb_t *p[4];
+        limb_t *table, *sq;
+        unsigned val;
+
+        /* The odd powers u**(2j + 1), j < 2**(k - 1), which need n * 4**(k - 1)
+           places together, and u**2 for stepping between them. */
+        table = scratch_alloc(size);
+        sq = table + (size_t)n * (1 << (2 * k - 2));
+        p[0] = u;
+        odd[0] = n;
+        if (k > 1) {
+                sqr(n, u, sq);
+                sq_len = normalized_length(2 * n, sq);
+                l = 0;
+                for (j = 1; j < 1 << (k - 1); j++) {
+                        mul(odd[j - 1], sq_len, p[j - 1], sq, table + l);
+                        p[j] = table + l;
+                        odd[j] = normalized_length(odd[j - 1] + sq_len,
+                                                   table + l);
+                        l += odd[j - 1] + sq_len;
+                }
+        }
+
+        for (i = bits - 1; i >= 0; i = l - 1) {
+                if ((e >> i & 1) == 0) {
+                        power_mul(x, &len, len, *x, t);
+                        l = i;
+                        continue;
+                }
+
+                /* The window e[i..l], which ends in a one. */
+                l = i - k + 1 < 0 ? 0 : i - k + 1;
+                while ((e >> l & 1) == 0) {
+                        l++;
+                }
+                val = (unsigned)(e >> l) & ((1u << (i - l + 1)) - 1);
+
+                if (len == 0) {
+                        memcpy(*x, p[val / 2], sizeof(p[0][0]) * odd[val / 2]);
+                        len = odd[val / 2];
+                        continue;
+                }
+                for (j = l; j <= i; j++) {
+                        power_mul(x, &len, len, *x, t);
+                }
+                power_mul(x, &len, odd[val / 2], p[val / 2], t);
+        }
+
+        scratch_free(table, size);
+
+        return len;
+}
+
+/* Raise n-place u to the power e > 0 into w, which must have size places: at
+   least one more than the result. Returns the length of the result. */
+static int power(int n, const limb_t *u, uint64_t e, int size, limb_t *w)
+{
+        size_t t_size = sizeof(limb_t) * size;
+        limb_t *x = w, *t;
+        int bits = 64, len;
+
+        assert(n > 0 && e > 0);
+
+        while ((e >> (bits - 1)) == 0) {
+                bits--;
+        }
+
+        t = scratch_alloc(t_size);
+        if (n == 1 && u[0] % 2 == 1 && u[0] < POW_CACHE_BASES && bits < 32 &&
+            bit_length(1, u) << (bits - 1) <= POW_CACHE_LIMBS * LIMB_BITS) {
+                len = power_cached(u[0], e, bits, &x, &t);
+        } else {
+                len = power_window(n, u, e, bits, &x, &t);
+        }
+
+        /* The buffers trade places with each product. */
+        if (x != w) {
+                memcpy(w, x, sizeof(w[0]) * len);
+                t = x;
+        }
+        scratch_free(t, t_size);
+
+        return len;
+}
+
+/* Size at which to_string() stops splitting and divides by 10**DEC_DIGITS. */
+#ifndef TOSTRING_THRESHOLD
+#define TOSTRING_THRESHOLD 30
+#endif
+
+/*
+   Write n-place integer u to s in decimal, with leading zeros to make it at
+   least width digits, and return a pointer to the end of the digits. This
+   takes time quadratic in n.
+ */
+static char *to_string_basecase(int n, const limb_t *u, int width, char *s)
+{
+        size_t size = sizeof(limb_t) * n;
+        char *start, *end, t;
+        limb_t *v;
+        limb_t k;
+        int i;
+
+        /* Skip leading zeros. */
+        while (n && u[n - 1] == 0) {
+                n--;
+        }
+
+        /* Make a scratch copy to do division on. */
+        v = scratch_alloc(size);
+        memcpy(v, u, sizeof(v[0]) * n);
+
+        start = s;
+        while (n != 0) {
+                /* Divide by 10**DEC_DIGITS to get the least significant
+                   decimals. */
+                short_division(n, v, DEC_BASE, v, &k);
+
+                /* Skip leading zeros. */
+                while (n && v[n - 1] == 0) {
+                        n--;
+                }
+
+                /* Add the digits to the string in reverse, with padding unless
+                   this is the most significant group of digits (n == 0). */
+                for (i = 0; (n != 0 && i < DEC_DIGITS) || k; i++) {
+                        *s++ = '0' + (k % 10);
+                        k /= 10;
+                }
+        }
+
+        scratch_free(v, size);
+
+        while (s - start < width) {
+                *s++ = '0';
+        }
+
+        /* Reverse the digits. */
+        end = s--;
+        while (start < s) {
+                t = *start;
+                *start++ = *s;
+                *s-- = t;
+        }
+
+        return end;
+}
+
+/*
+   Write n-place integer u < 10**(DEC_DIGITS * 2**k) to s in decimal and
+   return a pointer to the end of the digits. If pad is set, the output has
+   leading zeros to make it exactly DEC_DIGITS * 2**k digits.
+
+   Each step splits u into a quotient and remainder by 10**(DEC_DIGITS *
+   2**(k - 1)) and converts both halves recursively, so that the work is
+   dominated by a few large divisions instead of n small ones. Large low
+   halves are converted on another thread, straight into place when the
+   width of the high half is known, and into a buffer otherwise.
+ */
+static char *to_string_rec(int n, const limb_t *u, int k, bool pad, char *s);
+
+struct to_string_task {
+        struct pool_task task;
+        int n, k;
+        const limb_t *u;
+        char *s;
+};
+
+static void to_string_run(void *arg)
+{
+        struct to_string_task *t = arg;
+
+        to_string_rec(t->n, t->u, t->k, true, t->s);
+}
+
+static char *to_string_rec(int n, const limb_t *u, int k, bool pad, char *s)
+{
+        const struct pow10 *p;
+        struct to_string_task low;
+        limb_t *q, *r;
+        size_t size, width;
+        char *buf;
+        int q_len;
+
+        while (n && u[n - 1] == 0) {
+                n--;
+        }
+
+        if (k == 0 || n < TOSTRING_THRESHOLD) {
+                return to_string_basecase(n, u, pad ? DEC_DIGITS << k : 0, s);
+        }
+
+        p = pow10_get(k - 1);
+
+        if (n < p->length) {
+                /* The high half is all zeros. */
+                if (pad) {
+                        memset(s, '0', DEC_DIGITS << (k - 1));
+                        s += DEC_DIGITS << (k - 1);
+                }
+                return to_string_rec(n, u, k - 1, pad, s);
+        }
+
+        q_len = n - p->length + 1;
+        size = sizeof(limb_t) * (q_len + p->length);
+        q = scratch_alloc(size);
+        r = q + q_len;
+
+        pow10_divrem(n, u, p, q, r);
+
+        while (q_len && q[q_len - 1] == 0) {
+                q_len--;
+        }
+
+        if (q_len != 0 && n >= PARALLEL_THRESHOLD && pool_threads() > 1) {
+                width = (size_t)DEC_DIGITS << (k - 1);
+                buf = pad ? NULL : scratch_alloc(width);
+                low = (struct to_string_task){.n = p->length, .k = k - 1,
+                                              .u = r,
+                                              .s = pad ? s + width : buf};
+                pool_fork(&low.task, to_string_run, &low);
+                s = to_string_rec(q_len, q, k - 1, pad, s);
+                pool_join(&low.task);
+
+                if (buf != NULL) {
+                        memcpy(s, buf, width);
+                        scratch_free(buf, width);
+                }
+                s += width;
+        } else {
+                if (q_len != 0 || pad) {
+                        s = to_string_rec(q_len, q, k - 1, pad, s);
+                        pad = true;
+                }
+                s = to_string_rec(p->length, r, k - 1, pad, s);
+        }
+
+        scratch_free(q, size);
+
+        return s;
+}
+
+/* Find the smallest k such that u < 10**(DEC_DIGITS * 2**k), for n-place
+   u without leading zeros. */
+static int decimal_order(int n, const limb_t *u)
+{
+        int k;
+
+        for (k = 0; cmp(n, u, pow10_get(k)->length, pow10_get(k)->data) >= 0;
+             k++) {
+        }
+
+        return k;
+}
+
+/* Write the decimals of u to s, without leading zeros, and return the end. */
+static char *limb_to_string(limb_t u, char *s)
+{
+        char t[LIMB_DIGITS];
+        int i = 0;
+
+        do {
+                t[i++] = '0' + u % 10;
+                u /= 10;
+        } while (u != 0);
+
+        while (i > 0) {
+                *s++ = t[--i];
+        }
+
+        return s;
+}
+
+/* Turn n-place integer u into decimal string str. */
+static void to_string(int n, const limb_t *u, char *str)
+{
+        /* Skip leading zeros. */
+        while (n && u[n - 1] == 0) {
+                n--;
+        }
+
+        /* Special case for zero to avoid generating an empty string. */
+        if (n == 0) {
+                str[0] = '0';
+                str[1] = '\0';
+                return;
+        }
+        if (n == 1) {
+                *limb_to_string(u[0], str) = '\0';
+                return;
+        }
+
+        *to_string_rec(n, u, decimal_order(n, u), false, str) = '\0';
+}
+
+/* Size of the buffer for streamed output, in bytes. */
+#ifndef WRITE_BLOCK
+#define WRITE_BLOCK (1024 * 1024)
+#endif
+
+/* Streamed output: digits are gathered in buf and written to file, or to fd
+   if file is NULL, a block at a time. */
+struct writer {
+        FILE *file;
+        int fd;
+        bool failed;
+        size_t len;
+        char *buf;
+};
+
+static void writer_flush(struct writer *w)
+{
+        size_t done = 0;
+        ssize_t r;
+
+        if (w->file != NULL) {
+                if (!w->failed &&
+                    fwrite(w->buf, 1, w->len, w->file) != w->len) {
+                        w->failed = true;
+                }
+        } else {
+                while (!w->failed && done < w->len) {
+                        r = write(w->fd, w->buf + done, w->len - done);
+                        if (r >= 0) {
+                                done += r;
+                        } else if (errno != EINTR) {
+                                w->failed = true;
+                        }
+                }
+        }
+
+        w->len = 0;
+}
+
+/* Get room for n <= WRITE_BLOCK more characters at the end of w->buf. */
+static char *writer_reserve(struct writer *w, size_t n)
+{
+        if (WRITE_BLOCK - w->len < n) {
+                writer_flush(w);
+        }
+
+        return w->buf + w->len;
+}
+
+/*
+   Write n-place integer u < 10**(DEC_DIGITS * 2**k) to w as to_string_rec()
+   would. Pieces that fit in the buffer are converted straight into it, and
+   larger ones are split the same way as by to_string_rec(), so that only
+   the limbs of the pending halves are kept, not their digits.
+ */
+static void to_stream(struct writer *w, int n, const limb_t *u, int k,
+                      bool pad)
+{
+        const struct pow10 *p;
+        size_t size, width, c;
+        limb_t *q, *r;
+        int q_len;
+
+        while (n && u[n - 1] == 0) {
+                n--;
+        }
+
+        if (((size_t)DEC_DIGITS << k) <= WRITE_BLOCK) {
+                w->len = to_string_rec(n, u, k, pad,
+                                       writer_reserve(w, DEC_DIGITS << k)) -
+                         w->buf;
+                return;
+        }
+
+        p = pow10_get(k - 1);
+
+        if (n < p->length) {
+                if (pad) {
+                        for (width = (size_t)DEC_DIGITS << (k - 1); width > 0;
+                             width -= c) {
+                                c = width < WRITE_BLOCK ? width : WRITE_BLOCK;
+                                memset(writer_reserve(w, c), '0', c);
+                                w->len += c;
+                        }
+                }
+                to_stream(w, n, u, k - 1, pad);
+                return;
+        }
+
+        q_len = n - p->length + 1;
+        size = sizeof(limb_t) * (q_len + p->length);
+        q = scratch_alloc(size);
+        r = q + q_len;
+
+        pow10_divrem(n, u, p, q, r);
+
+        while (q_len && q[q_len - 1] == 0) {
+                q_len--;
+        }
+
+        if (q_len != 0 || pad) {
+                to_stream(w, q_len, q, k - 1, pad);
+                pad = true;
+        }
+        to_stream(w, p->length, r, k - 1, pad);
+
+        scratch_free(q, size);
+}
+
+/* Size, in limbs, at which from_string() stops splitting the input. */
+#ifndef FROMSTRING_THRESHOLD
+#define FROMSTRING_THRESHOLD 30
+#endif
+
+/*
+   Convert n-character decimal string str into integer u, which must have room
+   for n / DEC_DIGITS + 1 places.
+
+   Long strings are split into a high part and a low part of
+   DEC_DIGITS * 2**k digits, which are converted recursively and combined as
+   high * 10**(DEC_DIGITS * 2**k) + low, using the cached powers from
+   pow10_get() and the fast multiplication. Large low parts are converted on
+   another thread.
+ */
+static void from_string(int n, const char *str, int *u_len, limb_t *u);
+
+struct from_string_task {
+        struct pool_task task;
+        int n, u_len;
+        const char *str;
+        limb_t *u;
+};
+
+static void from_string_run(void *arg)
+{
+        struct from_string_task *t = arg;
+
+        from_string(t->n, t->str, &t->u_len, t->u);
+}
+
+static void from_string(int n, const char *str, int *u_len, limb_t *u)
+{
+        const struct pow10 *p;
+        struct from_string_task low;
+        int k, lo_digits, hi_len;
+        limb_t *hi, *lo;
+        size_t size;
+        bool parallel;
+
+        if (n <= DEC_DIGITS * FROMSTRING_THRESHOLD) {
+                from_string_basecase(n, str, u_len, u);
+                return;
+        }
+
+        /* Make the low part the largest power-of-two number of chunks that
+           leaves a non-empty high part. */
+        for (k = 0; (DEC_DIGITS << (k + 1)) < n; k++) {
+        }
+        lo_digits = DEC_DIGITS << k;
+        p = pow10_get(k);
+
+        size = sizeof(limb_t) * ((n - lo_digits) / DEC_DIGITS + 1 +
+                                 lo_digits / DEC_DIGITS + 1);
+        hi = scratch_alloc(size);
+        lo = hi + (n - lo_digits) / DEC_DIGITS + 1;
+
+        low = (struct from_string_task){.n = lo_digits,
+                                        .str = str + n - lo_digits, .u = lo};
+        parallel = n >= DEC_DIGITS * PARALLEL_THRESHOLD;
+        if (parallel) {
+                pool_fork(&low.task, from_string_run, &low);
+        }
+        from_string(n - lo_digits, str, &hi_len, hi);
+        if (parallel) {
+                pool_join(&low.task);
+        } else {
+                from_string_run(&low);
+        }
+
+        /* u = hi * p + lo, where 10**DEC_DIGITS < 2**LIMB_BITS keeps the
+           result within n / DEC_DIGITS + 1 places. */
+        *u_len = hi_len + p->length;
+        memset(u, 0, sizeof(u[0]) * p->zeros);
+        mul(hi_len, p->length - p->zeros, hi, p->data + p->zeros,
+            u + p->zeros);
+        add_in(*u_len, u, low.u_len, lo);
+
+        while (*u_len > 0 && u[*u_len - 1] == 0) {
+                (*u_len)--;
+        }
+
+        scratch_free(hi, size);
+}
+
+struct bigint_t {
+        uint32_t length : 31;
+        uint32_t negative : 1;
+        uint32_t capacity;      /* Number of limbs allocated for data. */
+        limb_t data[];
+};
+
+/* Get the length of the longer of x and y. */
+static uint32_t longest(const bigint_t *x, const bigint_t *y)
+{
+        return x->length > y->length ? x->length : y->length;
+}
+
+/*
+   Small values. Most numbers fit in a limb or two, so every bigint gets room
+   for at least SMALL_LIMBS limbs, which lets a result that grows by a limb
+   stay in its destination, and the arithmetic functions below work on
+   one-limb operands with a single double-limb operation instead of the
+   general algorithms and their scratch buffers.
+ */
+#define SMALL_LIMBS 2
+
+/* Allocate a bigint with room for n limbs. */
+static bigint_t *allocate(int n)
+{
+        bigint_t *res;
+
+        if (n < SMALL_LIMBS) {
+                n = SMALL_LIMBS;
+        }
+
+        res = checked_alloc(alloc_fn, sizeof(*res) + sizeof(limb_t) * n);
+        res->capacity = n;
+
+        return res;
+}
+
+/* Get a bigint with room for n limbs to hold a result that replaces dst:
+   dst itself if it is large enough, otherwise a new one. dst may still be an
+   operand, so it is not released here; see replace. */
+static bigint_t *reserve(bigint_t *dst, int n)
+{
+        if (dst != NULL && dst->capacity >= (uint32_t)n) {
+                return dst;
+        }
+
+        return allocate(n);
+}
+
+/*
+   Limbs of room beyond its length that a new result may keep. Results are
+   formed in place at the largest length they might have, so replace() gives
+   back more than this with realloc(), which can shrink a block where it is.
+ */
+#ifndef TRIM_SLACK
+#define TRIM_SLACK 64
+#endif
+
+/* Set the size and sign of z, whose first n limbs hold its magnitude with
+   possible leading zeros, and release dst if z replaced it. */
+static bigint_t *replace(bigint_t *dst, bigint_t *z, int n, bool negative)
+{
+        uint32_t cap;
+        bigint_t *t;
+
+        /* Strip leading zeros. A bigint_t will never contain leading zeros. */
+        while (n > 0 && z->data[n - 1] == 0) {
+                n--;
+        }
+
+        z->length = n;
+        z->negative = (n != 0 && negative);
+
+        if (z != dst) {
+                bigint_free(dst);
+
+                /* A failure to shrink leaves z as it was. */
+                cap = n < SMALL_LIMBS ? SMALL_LIMBS : n;
+                if (z->capacity > cap + TRIM_SLACK) {
+                        t = realloc_fn(z, sizeof(*z) + sizeof(limb_t) * cap);
+                        if (t != NULL) {
+                                z = t;
+                                z->capacity = cap;
+                        }
+                }
+        }
+
+        return z;
+}
+
+/* Store n-place u in dst, which may be NULL, and return the result. u may
+   be dst's own data. */
+static bigint_t *store(bigint_t *dst, int n, const limb_t *u, bool negative)
+{
+        bigint_t *z;
+
+        while (n > 0 && u[n - 1] == 0) {
+                n--;
+        }
+
+        z = reserve(dst, n);
+        if (n > 0) {
+                memmove(z->data, u, sizeof(z->data[0]) * n);
+        }
+
+        return replace(dst, z, n, negative);
+}
+
+/* Get the magnitude of x, which has at most one limb. */
+static limb_t small_value(const bigint_t *x)
+{
+        assert(x->length <= 1);
+
+        return x->length ? x->data[0] : 0;
+}
+
+/* Store the double-limb magnitude u over dst, like store(). */
+static bigint_t *store_small(bigint_t *dst, dlimb_t u, bool negative)
+{
+        bigint_t *z;
+
+        z = reserve(dst, 2);
+        z->data[0] = (limb_t)u;
+        z->data[1] = (limb_t)(u >> LIMB_BITS);
+
+        return replace(dst, z, 2, negative);
+}
+
+bigint_t *bigint_create(int n, const uint32_t *u, bool negative)
+{
+        bigint_t *res;
+        int i;
+
+        while (n > 0 && u[n - 1] == 0) {
+                n--;
+        }
+
+        res = allocate((n + LIMB_WORDS - 1) / LIMB_WORDS);
+
+        res->length = (n + LIMB_WORDS - 1) / LIMB_WORDS;
+        res->negative = (n != 0 && negative);
+
+        /* Pack the words into limbs, least significant first. */
+        memset(res->data, 0, sizeof(res->data[0]) * res->length);
+        for (i = 0; i < n; i++) {
+                res->data[i / LIMB_WORDS] |=
+                        (limb_t)u[i] << (32 * (i % LIMB_WORDS));
+        }
+
+        return res;
+}
+static bigint_t *create_str(int n, const char *str)
+{
+        bigint_t *res;
+        bool negative = false;
+        limb_t chunk;
+        int u_length;
+
+        assert(n > 0 && "Empty string is not a valid number.");
+
+        if (str[0] == '-') {
+                assert(n > 1 && "Just '-' is not a valid number.");
+                negative = true;
+                str++;
+                n--;
+        }
+
+        if (n <= DEC_DIGITS) {
+                from_string_basecase(n, str, &u_length, &chunk);
+                return store_small(NULL, u_length ? chunk : 0, negative);
+        }
+
+        /* A limb holds at least DEC_DIGITS decimals. */
+        res = allocate(n / DEC_DIGITS + 1);
+        from_string(n, str, &u_length, res->data);
+
+        return replace(NULL, res, u_length, negative);
+}
+
+bigint_t *bigint_create_str(int n, const char *str)
+{
+        uint64_t start = stat_start();
+        bigint_t *res;
+
+        res = create_str(n, str);
+        stat_stop(STAT_CREATE_STR, start, res->length);
+
+        return res;
+}
+
+/* Get the value of hex digit c. */
+static int hex_value(char c)
+{
+        if (c >= '0' && c <= '9') {
+                return c - '0';
+        }
+        if (c >= 'a' && c <= 'f') {
+                return c - 'a' + 10;
+        }
+
+        assert(c >= 'A' && c <= 'F' && "Not a hex digit!");
+        return c - 'A' + 10;
+}
+
+static bigint_t *create_hex(int n, const char *str)
+{
+        bool negative = false;
+        bigint_t *res;
+        int i, len;
+
+        assert(n > 0 && "Empty string is not a valid number.");
+
+        if (str[0] == '-') {
+                negative = true;
+                str++;
+                n--;
+        }
+        if (n > 2 && str[0] == '0' && (str[1] == 'x' || str[1] == 'X')) {
+                str += 2;
+                n -= 2;
+        }
+
+        assert(n > 0 && "No hex digits.");
+
+        /* The last digit is the least significant. */
+        len = (n + HEX_DIGITS - 1) / HEX_DIGITS;
+        res = allocate(len);
+        memset(res->data, 0, sizeof(res->data[0]) * len);
+        for (i = 0; i < n; i++) {
+                res->data[i / HEX_DIGITS] |= (limb_t)hex_value(str[n - 1 - i])
+                                             << (4 * (i % HEX_DIGITS));
+        }
+
+        return replace(NULL, res, len, negative);
+}
+
+bigint_t *bigint_create_hex(int n, const char *str)
+{
+        uint64_t start = stat_start();
+        bigint_t *res;
+
+        res = create_hex(n, str);
+        stat_stop(STAT_CREATE_HEX, start, res->length);
+
+        return res;
+}
+
+bigint_t *bigint_create_raw(size_t n, const void *data, bool negative)
+{
+        const unsigned char *p = data;
+        bigint_t *res;
+        int len;
+#ifndef HAVE_LITTLE_ENDIAN
+        size_t i;
+#endif
+
+        while (n > 0 && p[n - 1] == 0) {
+                n--;
+        }
+
+        assert(n / LIMB_BYTES < INT32_MAX && "Number too long!");
+
+        len = (n + LIMB_BYTES - 1) / LIMB_BYTES;
+        res = allocate(len);
+        memset(res->data, 0, sizeof(res->data[0]) * len);
+#ifdef HAVE_LITTLE_ENDIAN
+        memcpy(res->data, p, n);
+#else
+        for (i = 0; i < n; i++) {
+                res->data[i / LIMB_BYTES] |= (limb_t)p[i]
+                                             << (8 * (i % LIMB_BYTES));
+        }
+#endif
+
+        return replace(NULL, res, len, negative);
+}
+
+size_t bigint_raw_size(const bigint_t *x)
+{
+        size_t n = (size_t)LIMB_BYTES * x->length;
+
+        while (n > 0 && (uint8_t)(x->data[(n - 1) / LIMB_BYTES] >>
+                                  (8 * ((n - 1) % LIMB_BYTES))) == 0) {
+                n--;
+        }
+
+        return n;
+}
+
+bool bigint_export_raw(const bigint_t *x, void *data)
+{
+        size_t n = bigint_raw_size(x);
+        unsigned char *p = data;
+#ifndef HAVE_LITTLE_ENDIAN
+        size_t i;
+#endif
+
+#ifdef HAVE_LITTLE_ENDIAN
+        memcpy(p, x->data, n);
+#else
+        for (i = 0; i < n; i++) {
+                p[i] = (unsigned char)(x->data[i / LIMB_BYTES] >>
+                                       (8 * (i % LIMB_BYTES)));
+        }
+#endif
+
+        return x->negative;
+}
+
+size_t bigint_max_stringlen(const bigint_t *x)
+{
+        if (x->length == 0) {
+                return 1;
+        }
+
+        /* LIMB_DIGITS digits per limb, one more for '-'. */
+        return x->length * LIMB_DIGITS + x->negative;
+}
+
+void bigint_tostring(const bigint_t *x, char *str)
+{
+        uint64_t start = stat_start();
+
+        if (x->negative) {
+                *str++ = '-';
+        }
+
+        to_string(x->length, x->data, str);
+        stat_stop(STAT_TOSTRING, start, x->length);
+
+        assert(strlen(str) <= bigint_max_stringlen(x));
+}
+
+/* Write x in decimal to w, returning 0 or EOF on failure. */
+static int print(struct writer *w, const bigint_t *x)
+{
+        uint64_t start = stat_start();
+
+        w->failed = false;
+        w->len = 0;
+        w->buf = scratch_alloc(WRITE_BLOCK);
+
+        if (x->negative) {
+                w->buf[w->len++] = '-';
+        }
+
+        if (x->length <= 1) {
+                w->len = limb_to_string(small_value(x), w->buf + w->len) -
+                         w->buf;
+        } else {
+                to_stream(w, x->length, x->data,
+                          decimal_order(x->length, x->data), false);
+        }
+
+        writer_flush(w);
+        scratch_free(w->buf, WRITE_BLOCK);
+        stat_stop(STAT_PRINT, start, x->length);
+
+        return w->failed ? EOF : 0;
+}
+
+size_t bigint_max_hexlen(const bigint_t *x)
+{
+        /* "0x", and one more for '-'. */
+        return (x->length ? x->length * HEX_DIGITS : 1) + 2 + x->negative;
+}
+
+/* Write the sign and "0x" prefix of x to s, and return the end. */
+static char *hex_prefix(const bigint_t *x, char *s)
+{
+        if (x->negative) {
+                *s++ = '-';
+        }
+        *s++ = '0';
+        *s++ = 'x';
+
+        if (x->length == 0) {
+                *s++ = '0';
+        }
+
+        return s;
+}
+
+/* Write the hex digits of limb i of x to s, without leading zeros if it is
+   the top one, and return the end. */
+static char *hex_limb(const bigint_t *x, int i, char *s)
+{
+        static const char digits[] = "0123456789abcdef";
+        limb_t v = x->data[i];
+        int j = HEX_DIGITS;
+
+        if (i == (int)x->length - 1) {
+                while ((v >> (4 * (j - 1))) == 0) {
+                        j--;
+                }
+        }
+
+        while (j-- > 0) {
+                *s++ = digits[(v >> (4 * j)) & 15];
+        }
+
+        return s;
+}
+
+void bigint_tohex(const bigint_t *x, char *str)
+{
+        uint64_t start = stat_start();
+        int i;
+
+        str = hex_prefix(x, str);
+        for (i = x->length - 1; i >= 0; i--) {
+                str = hex_limb(x, i, str);
+        }
+        *str = '\0';
+        stat_stop(STAT_TOHEX, start, x->length);
+}
+
+int bigint_fprint_hex(FILE *f, const bigint_t *x)
+{
+        uint64_t start = stat_start();
+        struct writer w = {.file = f};
+        int i;
+
+        w.buf = scratch_alloc(WRITE_BLOCK);
+
+        w.len = hex_prefix(x, w.buf) - w.buf;
+        for (i = x->length - 1; i >= 0; i--) {
+                w.len = hex_limb(x, i, writer_reserve(&w, HEX_DIGITS)) - w.buf;
+        }
+
+        writer_flush(&w);
+        scratch_free(w.buf, WRITE_BLOCK);
+        stat_stop(STAT_PRINT, start, x->length);
+
+        return w.failed ? EOF : 0;
+}
+
+int bigint_fprint(FILE *f, const bigint_t *x)
+{
+        struct writer w = {.file = f};
+
+        return print(&w, x);
+}
+
+int bigint_write(int fd, const bigint_t *x)
+{
+        struct writer w = {.fd = fd};
+
+        return print(&w, x);
+}
+
+void bigint_print(const bigint_t *x)
+{
+        bigint_fprint(stdout, x);
+        putchar('\n');
+}
+
+/*
+   Binary files. An 8-byte preamble of "BGNT", the format version, the limb
+   size in bits and two zero bytes is followed by the bigint_t as it is laid
+   out in memory, in little-endian order: a 32-bit word holding the length in
+   limbs with the sign in its top bit, a 32-bit capacity equal to the length,
+   and the limbs. On a little-endian machine with the same limb size, a
+   mapped file thus serves as the bigint itself.
+ */
+#define FILE_MAGIC "BGNT"
+#define FILE_VERSION 1
+#define FILE_PREAMBLE 8
+#define FILE_HEADER (FILE_PREAMBLE + 8)
+
+struct bigint_file_t {
+        void *base;             /* The mapping. */
+        size_t size;
+        const bigint_t *value;  /* In the mapping, or a copy if not NULL. */
+        bigint_t *copy;
+};
+
+/* Store the 32-bit word x at p in little-endian order. */
+static void put_le32(unsigned char *p, uint32_t x)
+{
+        int i;
+
+        for (i = 0; i < 4; i++) {
+                p[i] = (unsigned char)(x >> (8 * i));
+        }
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+        return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+               (uint32_t)p[3] << 24;
+}
+
+int bigint_save(const char *path, const bigint_t *x)
+{
+        unsigned char header[FILE_HEADER] = FILE_MAGIC;
+        bool ok;
+        FILE *f;
+#ifndef HAVE_LITTLE_ENDIAN
+        unsigned char limb[LIMB_BYTES];
+        int i, j;
+#endif
+
+        header[4] = FILE_VERSION;
+        header[5] = LIMB_BITS;
+        put_le32(header + FILE_PREAMBLE,
+                 x->length | (uint32_t)x->negative << 31);
+        put_le32(header + FILE_PREAMBLE + 4, x->length);
+
+        f = fopen(path, "wb");
+        if (f == NULL) {
+                return EOF;
+        }
+
+        ok = fwrite(header, 1, sizeof(header), f) == sizeof(header);
+#ifdef HAVE_LITTLE_ENDIAN
+        ok = ok && fwrite(x->data, LIMB_BYTES, x->length, f) == x->length;
+#else
+        for (i = 0; ok && i < (int)x->length; i++) {
+                for (j = 0; j < LIMB_BYTES; j++) {
+                        limb[j] = (unsigned char)(x->data[i] >> (8 * j));
+                }
+                ok = fwrite(limb, 1, LIMB_BYTES, f) == LIMB_BYTES;
+        }
+#endif
+
+        if (fclose(f) != 0 || !ok) {
+                return EOF;
+        }
+
+        return 0;
+}
+
+bigint_file_t *bigint_map(const char *path)
+{
+        const unsigned char *p;
+        bigint_file_t *file;
+        uint32_t word, length, bits;
+        struct stat st;
+        void *base;
+        int fd;
+
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+                return NULL;
+        }
+        if (fstat(fd, &st) != 0) {
+                close(fd);
+                return NULL;
+        }
+        if (st.st_size < FILE_HEADER) {
+                close(fd);
+                errno = EINVAL;
+                return NULL;
+        }
+
+        base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) {
+                return NULL;
+        }
+
+        p = base;
+        word = get_le32(p + FILE_PREAMBLE);
+        length = word & 0x7fffffff;
+        bits = p[5];
+        if (memcmp(p, FILE_MAGIC, 4) != 0 || p[4] != FILE_VERSION ||
+            (bits != 32 && bits != 64) ||
+            (uint64_t)st.st_size != FILE_HEADER + (uint64_t)length * bits / 8) {
+                munmap(base, st.st_size);
+                errno = EINVAL;
+                return NULL;
+        }
+
+        file = xmalloc(sizeof(*file));
+        file->base = base;
+        file->size = st.st_size;
+        file->copy = NULL;
+
+#ifdef HAVE_LITTLE_ENDIAN
+        /* Use the mapping in place if it is a valid bigint_t here. */
+        const bigint_t *x = (const bigint_t *)(p + FILE_PREAMBLE);
+
+        if (bits == LIMB_BITS && x->length == length &&
+            x->negative == word >> 31 &&
+            (length == 0 ? !x->negative : x->data[length - 1] != 0)) {
+                file->value = x;
+                return file;
+        }
+#endif
+
+        file->copy = bigint_create_raw((size_t)length * bits / 8,
+                                       p + FILE_HEADER, word >> 31);
+        file->value = file->copy;
+        munmap(base, st.st_size);
+        file->base = NULL;
+
+        return file;
+}
+
+const bigint_t *bigint_file_value(const bigint_file_t *file)
+{
+        return file->value;
+}
+
+void bigint_unmap(bigint_file_t *file)
+{
+        if (file->base != NULL) {
+                munmap(file->base, file->size);
+        }
+        bigint_free(file->copy);
+        free(file);
+}
+
+/* Store x + y, negated if negative is set, over dst. */
+static bigint_t *add(bigint_t *dst, int x_len, const limb_t *x,
+                     int y_len, const limb_t *y, bool negative)
+{
+        bigint_t *z;
+
+        if (x_len < y_len) {
+                return add(dst, y_len, y, x_len, x, negative);
+        }
+
+        assert(x_len >= y_len);
+
+        z = reserve(dst, x_len + 1);
+        algorithm_a(x_len, x, y_len, y, z->data);
+
+        return replace(dst, z, x_len + 1, negative);
+}
+
+/* Store x - y, negated if negative is set, over dst. */
+static bigint_t *sub(bigint_t *dst, int x_len, const limb_t *x,
+                     int y_len, const limb_t *y, bool negative)
+{
+        bigint_t *z;
+
+        if (cmp(x_len, x, y_len, y) < 0) {
+                /* x - y = -(y - x) */
+                return sub(dst, y_len, y, x_len, x, !negative);
+        }
+
+        assert(x_len >= y_len);
+
+        z = reserve(dst, x_len);
+        algorithm_s(x_len, x, y_len, y, z->data);
+
+        return replace(dst, z, x_len, negative);
+}
+
+/* Check whether x is a power of two, and if so, set *s to its exponent. */
+static bool power_of_two(const bigint_t *x, uint64_t *s)
+{
+        limb_t top;
+        int i;
+
+        if (x->length == 0) {
+                return false;
+        }
+
+        top = x->data[x->length - 1];
+        if ((top & (top - 1)) != 0) {
+                return false;
+        }
+        for (i = 0; i < (int)x->length - 1; i++) {
+                if (x->data[i] != 0) {
+                        return false;
+                }
+        }
+
+        *s = (uint64_t)(x->length - 1) * LIMB_BITS + trailing_zeros(top);
+
+        return true;
+}
+
+/* Store |x| * 2**s, negated if negative is set, over dst. */
+static bigint_t *shl(bigint_t *dst, const bigint_t *x, uint64_t s,
+                     bool negative)
+{
+        bigint_t *z;
+        int len;
+
+        if (x->length == 0) {
+                return store_small(dst, 0, false);
+        }
+
+        assert(s / LIMB_BITS < (uint64_t)INT_MAX / 2 - x->length &&
+               "Shift too large!");
+
+        z = reserve(dst, x->length + (int)(s / LIMB_BITS) + 1);
+        len = shift_up(x->length, x->data, s, z->data);
+
+        return replace(dst, z, len, negative);
+}
+
+/* Store |x| / 2**s, negated if negative is set, over dst. */
+static bigint_t *shr(bigint_t *dst, const bigint_t *x, uint64_t s,
+                     bool negative)
+{
+        bigint_t *z;
+        int len;
+
+        if (s / LIMB_BITS >= x->length) {
+                return store_small(dst, 0, false);
+        }
+
+        z = reserve(dst, x->length - (int)(s / LIMB_BITS));
+        len = shift_down(x->length, x->data, s, z->data);
+
+        return replace(dst, z, len, negative);
+}
+
+/* Store |x| mod 2**s, negated if negative is set, over dst. */
+static bigint_t *low_bits(bigint_t *dst, const bigint_t *x, uint64_t s,
+                          bool negative)
+{
+        uint64_t q = s / LIMB_BITS;
+        int r = (int)(s % LIMB_BITS), len = x->length;
+        bigint_t *z;
+
+        if (q < x->length) {
+                len = (int)q + (r != 0);
+        }
+
+        z = reserve(dst, len);
+        memmove(z->data, x->data, sizeof(z->data[0]) * len);
+        if (len == (int)q + 1) {
+                z->data[q] &= ((limb_t)1 << r) - 1;
+        }
+
+        return replace(dst, z, len, negative);
+}
+
+/* Store x + y, with y taken as negative if negative is set, over dst, for
+   one-limb x and y. */
+static bigint_t *add_small(bigint_t *dst, const bigint_t *x,
+                           const bigint_t *y, bool negative)
+{
+        limb_t u = small_value(x), v = small_value(y);
+
+        if (x->negative == negative) {
+                return store_small(dst, (dlimb_t)u + v, negative);
+        }
+        if (u >= v) {
+                return store_small(dst, u - v, x->negative);
+        }
+
+        return store_small(dst, v - u, negative);
+}
+
+static bigint_t *add_into(bigint_t *dst, const bigint_t *x,
+                          const bigint_t *y)
+{
+        if (x->length <= 1 && y->length <= 1) {
+                return add_small(dst, x, y, y->negative);
+        }
+
+        if (x->negative == y->negative) {
+                /* (-x) + (-y) = -(x + y) */
+                return add(dst, x->length, x->data, y->length, y->data,
+                           x->negative);
+        }
+
+        if (x->negative) {
+                assert(!y->negative);
+                /* (-x) + y = y - x */
+                return sub(dst, y->length, y->data, x->length, x->data, false);
+        }
+
+        assert(!x->negative && y->negative);
+
+        /* x + (-y) = x - y */
+        return sub(dst, x->length, x->data, y->length, y->data, false);
+}
+
+static bigint_t *sub_into(bigint_t *dst, const bigint_t *x,
+                          const bigint_t *y)
+{
+        if (x->length <= 1 && y->length <= 1) {
+                /* x - y = x + (-y) */
+                return add_small(dst, x, y, !y->negative);
+        }
+
+        if (x->negative != y->negative) {
+                /* (-x) - y = -(x + y), x - (-y) = x + y */
+                return add(dst, x->length, x->data, y->length, y->data,
+                           x->negative);
+        }
+
+        if (x->negative) {
+                assert(y->negative);
+                /* (-x) - (-y) = y - x */
+                return sub(dst, y->length, y->data, x->length, x->data, false);
+        }
+
+        assert(!x->negative && !y->negative);
+
+        return sub(dst, x->length, x->data, y->length, y->data, false);
+}
+
+static bigint_t *mul_into(bigint_t *dst, const bigint_t *x,
+                          const bigint_t *y)
+{
+        int n = x->length + y->length;
+        bool negative = x->negative ^ y->negative;
+        const limb_t *v = y->data;
+        size_t size;
+        uint64_t s;
+        limb_t *w;
+        bigint_t *z;
+
+        if (x->length <= 1 && y->length <= 1) {
+                return store_small(dst, (dlimb_t)small_value(x) *
+                                   small_value(y), negative);
+        }
+
+        /* A power of two only shifts the other operand. */
+        if (power_of_two(y, &s)) {
+                return shl(dst, x, s, negative);
+        }
+        if (power_of_two(x, &s)) {
+                return shl(dst, y, s, negative);
+        }
+
+        /* Equal magnitudes, as in (A)*(A), make mul() square. */
+        if (x->length == y->length &&
+            memcmp(x->data, y->data, sizeof(x->data[0]) * x->length) == 0) {
+                v = x->data;
+        }
+
+        if (dst != x && dst != y) {
+                z = reserve(dst, n);
+                mul(x->length, y->length, x->data, v, z->data);
+                return replace(dst, z, n, negative);
+        }
+
+        /* The product cannot be formed over its own operands. */
+        size = sizeof(limb_t) * n;
+        w = scratch_alloc(size);
+        mul(x->length, y->length, x->data, v, w);
+        z = store(dst, n, w, negative);
+        scratch_free(w, size);
+
+        return z;
+}
+
+/*
+   Divide x by y, storing the quotient over *q and the remainder over *r the
+   way the _into functions store over dst. Either of q and r may be NULL if
+   that result is not needed.
+ */
+static void divrem(const bigint_t *x, const bigint_t *y,
+                   bigint_t **q, bigint_t **r)
+{
+        int m = x->length - y->length;
+        bool negative = x->negative ^ y->negative;
+        size_t size;
+        uint64_t s;
+        limb_t *w, *wq, *wr, u, v;
+        bigint_t *zq, *zr;
+
+        assert(y->length > 0 && "Division by zero!");
+
+        if (x->length <= 1 && y->length == 1) {
+                u = small_value(x);
+                v = y->data[0];
+                /* Both are read before either result is stored. */
+                if (r != NULL) {
+                        *r = store_small(*r, u % v, x->negative);
+                }
+                if (q != NULL) {
+                        *q = store_small(*q, u / v, negative);
+                }
+                return;
+        }
+
+        if (power_of_two(y, &s)) {
+                /* Take the remainder first, unless it is stored over x. */
+                if (r != NULL && *r != x) {
+                        *r = low_bits(*r, x, s, x->negative);
+                }
+                if (q != NULL) {
+                        *q = shr(*q, x, s, negative);
+                }
+                if (r != NULL && *r == x) {
+                        *r = low_bits(*r, x, s, x->negative);
+                }
+                return;
+        }
+
+        if (m < 0) {
+                /* Take the remainder first, as x may be stored over by q. */
+                if (r != NULL) {
+                        *r = store(*r, x->length, x->data, x->negative);
+                }
+                if (q != NULL) {
+                        *q = store(*q, 0, NULL, false);
+                }
+                return;
+        }
+
+        /* Divide straight into the results, except those that are not
+           wanted or would be stored over an operand; those go to scratch. */
+        zq = q != NULL && *q != x && *q != y ? reserve(*q, m + 1) : NULL;
+        zr = r != NULL && *r != x && *r != y ? reserve(*r, y->length) : NULL;
+
+        size = sizeof(limb_t) * ((zq ? 0 : m + 1) + (zr ? 0 : y->length));
+        w = size ? scratch_alloc(size) : NULL;
+        wq = zq ? zq->data : w;
+        wr = zr ? zr->data : w + (zq ? 0 : m + 1);
+
+        divide(m, y->length, x->data, y->data, wq, wr);
+
+        if (r != NULL) {
+                *r = zr ? replace(*r, zr, y->length, x->negative) :
+                          store(*r, y->length, wr, x->negative);
+        }
+        if (q != NULL) {
+                *q = zq ? replace(*q, zq, m + 1, negative) :
+                          store(*q, m + 1, wq, negative);
+        }
+
+        if (size) {
+                scratch_free(w, size);
+        }
+}
+
+bigint_t *bigint_div_into(bigint_t *dst, const bigint_t *x, const bigint_t *y)
+{
+        uint64_t start = stat_start();
+        uint32_t len = longest(x, y);
+
+        divrem(x, y, &dst, NULL);
+        stat_stop(STAT_DIV, start, len);
+
+        return dst;
+}
+
+bigint_t *bigint_rem_into(bigint_t *dst, const bigint_t *x, const bigint_t *y)
+{
+        uint64_t start = stat_start();
+        uint32_t len = longest(x, y);
+
+        divrem(x, y, NULL, &dst);
+        stat_stop(STAT_DIV, start, len);
+
+        return dst;
+}
+
+void bigint_divrem(const bigint_t *x, const bigint_t *y,
+                   bigint_t **q, bigint_t **r)
+{
+        uint64_t start = stat_start();
+
+        if (q != NULL) {
+                *q = NULL;
+        }
+        if (r != NULL) {
+                *r = NULL;
+        }
+
+        divrem(x, y, q, r);
+        stat_stop(STAT_DIV, start, longest(x, y));
+}
+
+bigint_t *bigint_neg_into(bigint_t *dst, const bigint_t *x)
+{
+        uint64_t start = stat_start();
+        uint32_t len = x->length;
+
+        dst = store(dst, x->length, x->data, !x->negative);
+        stat_stop(STAT_NEG, start, len);
+
+        return dst;
+}
+
+/*
+   x = u * 2**s for odd u, so x**e = u**e * 2**(s * e). A power of two thus
+   takes a single shift, and other even bases get a smaller power to compute.
+ */
+static bigint_t *pow_into(bigint_t *dst, const bigint_t *x, uint64_t e)
+{
+        bool negative = x->negative && e % 2 == 1;
+        int i, n, size, len;
+        size_t u_size;
+        uint64_t bits, s;
+        limb_t *u;
+        bigint_t *z;
+
+        if (e == 0 || x->length == 0) {
+                return store_small(dst, e == 0, false);
+        }
+
+        for (i = 0; x->data[i] == 0; i++) {
+        }
+        s = (uint64_t)i * LIMB_BITS + trailing_zeros(x->data[i]);
+        bits = bit_length(x->length, x->data);
+        assert((bits == 1 || e <= (uint64_t)INT_MAX * LIMB_BITS / 2 / bits) &&
+               "Power too large!");
+
+        /* The odd part u. */
+        n = x->length - i;
+        u_size = sizeof(limb_t) * n;
+        u = scratch_alloc(u_size);
+        memcpy(u, x->data + i, u_size);
+        if (s % LIMB_BITS != 0) {
+                shift_right(n, u, s % LIMB_BITS);
+                n = normalized_length(n, u);
+        }
+
+        /* u**e goes straight into the result, and is shifted up in place. */
+        size = n == 1 && u[0] == 1 ? 1 : (int)((bits - s) * e / LIMB_BITS) + 2;
+        s *= e;
+        z = reserve(dst, size + (int)(s / LIMB_BITS) + 1);
+        if (size == 1) {
+                len = shift_up(1, u, s, z->data);
+        } else {
+                len = power(n, u, e, size, z->data);
+                len = shift_up(len, z->data, s, z->data);
+        }
+        z = replace(dst, z, len, negative);
+
+        scratch_free(u, u_size);
+
+        return z;
+}
+
+bigint_t *bigint_add_into(bigint_t *dst, const bigint_t *x, const bigint_t *y)
+{
+        uint64_t start = stat_start();
+        uint32_t len = longest(x, y);
+
+        dst = add_into(dst, x, y);
+        stat_stop(STAT_ADD, start, len);
+
+        return dst;
+}
+
+bigint_t *bigint_sub_into(bigint_t *dst, const bigint_t *x, const bigint_t *y)
+{
+        uint64_t start = stat_start();
+        uint32_t len = longest(x, y);
+
+        dst = sub_into(dst, x, y);
+        stat_stop(STAT_SUB, start, len);
+
+        return dst;
+}
+
+bigint_t *bigint_mul_into(bigint_t *dst, const bigint_t *x, const bigint_t *y)
+{
+        uint64_t start = stat_start();
+        uint32_t len = longest(x, y);
+
+        dst = mul_into(dst, x, y);
+        stat_stop(STAT_MUL, start, len);
+
+        return dst;
+}
+
+bigint_t *bigint_pow_into(bigint_t *dst, const bigint_t *x, uint64_t e)
+{
+        uint64_t start = stat_start();
+        uint32_t len = x->length;
+
+        dst = pow_into(dst, x, e);
+        stat_stop(STAT_POW, start, len);
+
+        return dst;
+}
+
+bigint_t *bigint_add(const bigint_t *x, const bigint_t *y)
+{
+        return bigint_add_into(NULL, x, y);
 }
 
-/* Copy n uint32_t values from u32 to u16. */
-static void u32_to_u16(int n, const uint32_t *u32, uint16_t *u16)
+bigint_t *bigint_sub(const bigint_t *x, const bigint_t *y)
 {
-        int i;
+        return bigint_sub_into(NULL, x, y);
+}
 
-        for (i = 0; i < n; i++) {
-                u16[i * 2 + 0] = (uint16_t)u32[i];
-                u16[i * 2 + 1] = (uint16_t)(u32[i] >> 16);
-        }
+bigint_t *bigint_mul(const bigint_t *x, const bigint_t *y)
+{
+        return bigint_mul_into(NULL, x, y);
 }
 
-/* Copy n uint16_t values from u16 to u32. */
-static void u16_to_u32(int n, const uint16_t *u16, uint32_t *u32)
+bigint_t *bigint_sqr_into(bigint_t *dst, const bigint_t *x)
 {
-        int i;
+        uint64_t start = stat_start();
+        uint32_t len = x->length;
 
-        assert((n % 2) == 0 && "Expected n to be even!");
+        dst = mul_into(dst, x, x);
+        stat_stop(STAT_SQR, start, len);
 
-        for (i = 0; i < n; i += 2) {
-                u32[i / 2] = u16[i] | ((uint32_t)u16[i + 1] << 16);
-        }
+        return dst;
 }
 
-/*
-   Divide (m + n)-place u with n-place v, yielding (m + 1)-place quotient q and
-   n-place remainder r.
- */
-static void algorithm_d_wrapper(int m, int n, const uint32_t *u,
-                                const uint32_t *v, uint32_t *q, uint32_t *r)
+bigint_t *bigint_shl_into(bigint_t *dst, const bigint_t *x, uint64_t n)
 {
-        /* To avoid having to do 64-bit divisions, convert to uint16_t. Also
-           extend the dividend one place, as that is required for the
-           normalization step. */
-
-        uint16_t u16[(m + n) * 2 + 1];
-        uint16_t v16[n * 2];
-        uint16_t q16[(m + 1) * 2];
-        bool v_zero;
-
-        assert(n > 0 && "Division by zero!");
-        assert(v[n - 1] != 0 && "v has leading zero!");
+        uint64_t start = stat_start();
+        uint32_t len = x->length;
 
-        u32_to_u16(m + n, u, u16);
-        u32_to_u16(n, v, v16);
+        dst = shl(dst, x, n, x->negative);
+        stat_stop(STAT_SHIFT, start, len);
 
-        /* If v16 has a leading zero, treat it as one place shorter. */
-        v_zero = (v16[n * 2 - 1] == 0);
+        return dst;
+}
 
-        algorithm_d(m * 2 + v_zero, n * 2 - v_zero, u16, v16, q16);
+bigint_t *bigint_shr_into(bigint_t *dst, const bigint_t *x, uint64_t n)
+{
+        uint64_t start = stat_start();
+        uint32_t len = x->length;
 
-        if (v_zero) {
-                /* If v16 was short, pad the remainder. */
-                u16[n * 2 - 1] = 0;
-        } else {
-                /* Pad the quotient. */
-                q16[(m + 1) * 2 - 1] = 0;
-        }
+        dst = shr(dst, x, n, x->negative);
+        stat_stop(STAT_SHIFT, start, len);
 
-        u16_to_u32((m + 1) * 2, q16, q);
-        u16_to_u32(n * 2, u16, r);
+        return dst;
 }
 
-/* Multiply m-place integer u by x and add y to it; set m to the new size. */
-static void multiply_add(uint32_t *u, int *m, uint32_t x, uint32_t y)
+bigint_t *bigint_sqr(const bigint_t *x)
 {
-        int i;
-        uint32_t k, hi_prod, lo_prod;
+        return bigint_sqr_into(NULL, x);
+}
 
-        k = y;
+bigint_t *bigint_pow(const bigint_t *x, uint64_t e)
+{
+        return bigint_pow_into(NULL, x, e);
+}
 
-        for (i = 0; i < *m; i++) {
-                mul_32_by_32(u[i], x, &hi_prod, &lo_prod);
-                lo_prod += k;
-                k = hi_prod + (lo_prod < k);
-                u[i] = lo_prod;
-        }
+bigint_t *bigint_shl(const bigint_t *x, uint64_t n)
+{
+        return bigint_shl_into(NULL, x, n);
+}
 
-        if (k) {
-                u[*m] = k;
-                (*m)++;
-        }
+bigint_t *bigint_shr(const bigint_t *x, uint64_t n)
+{
+        return bigint_shr_into(NULL, x, n);
 }
 
-/* Convert n-character decimal string str into integer u. */
-static void from_string(int n, const char *str, int *u_len, uint32_t *u)
+bigint_t *bigint_div(const bigint_t *x, const bigint_t *y)
 {
-        uint32_t chunk;
-        int i;
+        return bigint_div_into(NULL, x, y);
+}
 
-        static const uint32_t pow10s[] = {1000000000,
-                                          10,
-                                          100,
-                                          1000,
-                                          10000,
-                                          100000,
-                                          1000000,
-                                          10000000,
-                                          100000000};
+bigint_t *bigint_rem(const bigint_t *x, const bigint_t *y)
+{
+        return bigint_rem_into(NULL, x, y);
+}
 
-        *u_len = 0;
-        chunk = 0;
+bigint_t *bigint_neg(const bigint_t *x)
+{
+        return bigint_neg_into(NULL, x);
+}
 
-        /* Process the string in chunks of up to 9 characters, as 10**9 is the
-           largest power of 10 that fits in uint32_t. */
+int bigint_cmp(const bigint_t *x, const bigint_t *y)
+{
+        if (x->negative != y->negative) {
+                return x->negative ? -1 : 1;
+        }
 
-        for (i = 1; i <= n; i++) {
-                assert(*str >= '0' && *str <= '9');
-                chunk = chunk * 10 + *str++ - '0';
+        assert(x->negative == y->negative);
 
-                if (i % 9 == 0 || i == n) {
-                        multiply_add(u, u_len, pow10s[i % 9], chunk);
-                        chunk = 0;
-                }
+        if (x->negative) {
+                return cmp(y->length, y->data, x->length, x->data);
         }
+
+        return cmp(x->length, x->data, y->length, y->data);
 }
 
-/* Turn n-place integer u into decimal string str. */
-static void to_string(int n, const uint32_t *u, char *str)
+bool bigint_is_zero(const bigint_t *x)
 {
-        uint16_t v[n * 2];
-        uint16_t k;
-        char *s, t;
-        int i;
+        return x->length == 0;
+}
 
-        /* Make a scratch copy that's easy to do division on. */
-        u32_to_u16(n, u, v);
-        n *= 2;
+/*
+   Modular arithmetic. A bigint_mod_t holds an n-place modulus N with what is
+   precomputed for multiplying residues modulo it, which are kept as n-place
+   arrays while being worked on.
+
+   For odd N, residues are in Montgomery form, x * R mod N for R = B**n. The
+   product of two of them is reduced by adding the multiple of N that clears
+   its low n places and dropping those (REDC), which leaves x * y * R mod N
+   without any division. Sums and differences are the same in either form,
+   so only values entering and leaving need converting. Even N has no such
+   form, so its residues are the plain ones and its products are divided.
+ */
 
-        /* Skip leading zeros. */
-        while (n && v[n - 1] == 0) {
-                n--;
-        }
+/* Length of N from which REDC computes the multiple of N with two products,
+   rather than a place at a time. */
+#ifndef MONT_REDC_THRESHOLD
+#define MONT_REDC_THRESHOLD 200
+#endif
+
+struct bigint_mod_t {
+        int n;                  /* Places of N. */
+        bool odd;               /* Whether residues are in Montgomery form. */
+        limb_t inv;             /* -N**-1 mod B, for odd N. */
+        limb_t *one;            /* The residue of 1. */
+        limb_t *r2;             /* R**2 mod N, for odd N. */
+        limb_t *n_inv;          /* -N**-1 mod R, for odd N of at least
+                                   MONT_REDC_THRESHOLD places. */
+        limb_t data[];          /* N, followed by the above. */
+};
 
-        /* Special case for zero to avoid generating an empty string. */
-        if (n == 0) {
-                str[0] = '0';
-                str[1] = '\0';
-                return;
-        }
+/* Places of scratch for mod_mul() with n-place N. */
+#define MOD_SCRATCH(n) (3 * (n) + 1)
 
-        s = str;
-        while (n != 0) {
-                /* Divide by 10**4 to get the 4 least significant decimals. */
-                short_division(n, v, 10000, v, &k);
+/* Compute -v**-1 mod B for odd v by Newton's iteration, each step of which
+   doubles the number of correct low bits, starting from the three of v
+   itself. */
+static limb_t limb_inverse(limb_t v)
+{
+        limb_t x = v;
+        int bits;
 
-                /* Skip leading zeros. */
-                while (n && v[n - 1] == 0) {
-                        n--;
-                }
+        assert(v % 2 == 1);
 
-                /* Add the digits to the string in reverse, with padding unless
-                   this is the most significant group of digits (n == 0). */
-                for (i = 0; (n != 0 && i < 4) || k; i++) {
-                        *s++ = '0' + (k % 10);
-                        k /= 10;
-                }
+        for (bits = 3; bits < LIMB_BITS; bits *= 2) {
+                x *= 2 - v * x;
         }
 
-        /* Terminate and reverse the string. */
-        *s-- = '\0';
-        while (str < s) {
-                t = *str;
-                *str++ = *s;
-                *s-- = t;
-        }
+        return -x;
 }
 
-struct bigint_t {
-        uint32_t length : 31;
-        uint32_t negative : 1;
-        uint32_t data[];
-};
-
-bigint_t *bigint_create(int n, const uint32_t *u, bool negative)
+/*
+   Compute n-place x = -v**-1 mod B**n for odd n-place v, given inv = -v**-1
+   mod B. If v * x = -1 mod B**l, then x * (2 + v * x) is the inverse mod
+   B**(2l), so each step doubles the number of places.
+ */
+static void mod_inverse(int n, const limb_t *v, limb_t inv, limb_t *x)
 {
-        bigint_t *res;
-
-        /* Strip leading zeros. A bigint_t will never contain leading zeros. */
-        while (n > 0 && u[n - 1] == 0) {
-                n--;
-        }
-
-        res = malloc(sizeof(*res) + n * sizeof(uint32_t));
-        if (res == NULL) {
-                fprintf(stderr, "Out of memory!");
-                exit(1);
+        static const limb_t two = 2;
+        size_t size = sizeof(limb_t) * 4 * n;
+        limb_t *t, *p;
+        int h, l = 1;
+
+        t = scratch_alloc(size);
+        p = t + 2 * n;
+
+        x[0] = inv;
+        while (l < n) {
+                h = l;
+                l = 2 * h < n ? 2 * h : n;
+
+                mul(l, h, v, x, t);
+                add_in(l, t, 1, &two);
+                mul(h, l, x, t, p);
+                memcpy(x, p, sizeof(x[0]) * l);
         }
 
-        res->length = n;
+        scratch_free(t, size);
+}
 
-        if (n == 0) {
-                res->negative = false;
+/* Reduce 2n-place t < N * R, which is destroyed, to the n-place residue
+   t / R mod N in w. */
+static void redc(const bigint_mod_t *mod, limb_t *t, limb_t *w)
+{
+        int n = mod->n, i, j;
+        const limb_t *v = mod->data;
+        limb_t c = 0, k, q, *p;
+        size_t size;
+        dlimb_t s;
+
+        if (n < MONT_REDC_THRESHOLD) {
+                /* Clear a place at a time, keeping the carry out of each row
+                   to add in with the next. */
+                for (i = 0; i < n; i++) {
+                        q = t[i] * mod->inv;
+                        k = 0;
+                        for (j = 0; j < n; j++) {
+                                s = (dlimb_t)q * v[j] + t[i + j] + k;
+                                t[i + j] = (limb_t)s;
+                                k = (limb_t)(s >> LIMB_BITS);
+                        }
+                        s = (dlimb_t)t[i + n] + k + c;
+                        t[i + n] = (limb_t)s;
+                        c = (limb_t)(s >> LIMB_BITS);
+                }
         } else {
-                res->negative = negative;
-                memcpy(res->data, u, sizeof(res->data[0]) * n);
+                /* q = t * n_inv mod R clears all of the low half at once. */
+                size = sizeof(limb_t) * 4 * n;
+                p = scratch_alloc(size);
+                mul(n, n, t, mod->n_inv, p);
+                mul(n, n, p, v, p + 2 * n);
+                c = add_n(2 * n, t, p + 2 * n, t);
+                scratch_free(p, size);
         }
 
-        return res;
+        /* (t + q * N) / R < 2N, so N is taken off at most once. */
+        if (c != 0 || cmp(n, t + n, n, v) >= 0) {
+                sub_n(n, t + n, v, w);
+        } else {
+                memcpy(w, t + n, sizeof(w[0]) * n);
+        }
 }
 
-bigint_t *bigint_create_str(int n, const char *str)
+/* Multiply the n-place residues u and v into w, which may be either of them,
+   using t of MOD_SCRATCH(n) places. u and v may be the same, to square. */
+static void mod_mul(const bigint_mod_t *mod, const limb_t *u,
+                    const limb_t *v, limb_t *w, limb_t *t)
 {
-        uint32_t u[n / 9 + 1];  /* A uint32_t holds at least 9 decimals. */
-        bool negative = false;
-        int u_length;
-
-        assert(n > 0 && "Empty string is not a valid number.");
+        int n = mod->n;
 
-        if (str[0] == '-') {
-                assert(n > 1 && "Just '-' is not a valid number.");
-                negative = true;
-                str++;
-                n--;
+        mul(n, n, u, v, t);
+        if (mod->odd) {
+                redc(mod, t, w);
+        } else {
+                divide(n, n, t, mod->data, t + 2 * n, w);
         }
-
-        from_string(n, str, &u_length, u);
-
-        return bigint_create(u_length, u, negative);
 }
 
-size_t bigint_max_stringlen(const bigint_t *x)
+/* Check that x is a residue, from 0 to N - 1. */
+static void mod_check(const bigint_mod_t *mod, const bigint_t *x)
 {
-        if (x->length == 0) {
-                return 1;
-        }
+        assert(!x->negative &&
+               cmp(x->length, x->data, mod->n, mod->data) < 0 &&
+               "Not a residue!");
+        (void)mod;
+        (void)x;
+}
 
-        /* 10 digits per uint32_t, one more for '-'. */
-        return x->length * 10 + x->negative;
+/* Copy the residue x into n-place u. */
+static void mod_load(const bigint_mod_t *mod, const bigint_t *x, limb_t *u)
+{
+        mod_check(mod, x);
+        zero_extend(mod->n, u, x->length, x->data);
 }
 
-void bigint_tostring(const bigint_t *x, char *str)
+bigint_mod_t *bigint_mod_create(const bigint_t *x)
 {
-        if (x->negative) {
-                *str++ = '-';
+        int n = x->length;
+        bigint_mod_t *mod;
+        size_t size;
+        limb_t *t;
+
+        assert(n > 0 && !x->negative && "Modulus must be positive!");
+
+        mod = xmalloc(sizeof(*mod) + sizeof(limb_t) * 4 * n);
+        mod->n = n;
+        mod->odd = (x->data[0] % 2 == 1);
+        mod->one = mod->data + n;
+        mod->r2 = mod->n_inv = NULL;
+        memcpy(mod->data, x->data, sizeof(x->data[0]) * n);
+
+        if (!mod->odd) {
+                /* N > 1, so 1 is its own residue. */
+                zero_extend(n, mod->one, 1, &limb_one);
+                return mod;
         }
 
-        to_string(x->length, x->data, str);
+        mod->inv = limb_inverse(x->data[0]);
+        mod->r2 = mod->one + n;
+        if (n >= MONT_REDC_THRESHOLD) {
+                mod->n_inv = mod->r2 + n;
+                mod_inverse(n, mod->data, mod->inv, mod->n_inv);
+        }
 
-        assert(strlen(str) <= bigint_max_stringlen(x));
+        /* R**2 mod N by dividing, and the residue R mod N of 1 from it. */
+        size = sizeof(limb_t) * ((2 * n + 1) + (n + 2));
+        t = scratch_alloc(size);
+        memset(t, 0, sizeof(t[0]) * 2 * n);
+        t[2 * n] = 1;
+        divide(n + 1, n, t, mod->data, t + 2 * n + 1, mod->r2);
+        zero_extend(2 * n, t, n, mod->r2);
+        redc(mod, t, mod->one);
+        scratch_free(t, size);
+
+        return mod;
 }
 
-void bigint_print(const bigint_t *x)
+void bigint_mod_destroy(bigint_mod_t *mod)
 {
-        char str[bigint_max_stringlen(x) + 1];
-
-        bigint_tostring(x, str);
-        puts(str);
+        free(mod);
 }
 
-static bigint_t *add(int x_len, const uint32_t *x, int y_len, const uint32_t *y)
+/* Store the residue of x, of any size and sign, over dst. */
+static bigint_t *mod_enter(bigint_t *dst, const bigint_mod_t *mod,
+                           const bigint_t *x)
 {
-        if (x_len < y_len) {
-                return add(y_len, y, x_len, x);
-        }
-
-        int w_len = x_len + 1;
-        uint32_t w[w_len];
-        int i;
+        int n = mod->n, m = x->length - n;
+        size_t size;
+        limb_t *t, *u;
+        bigint_t *z;
 
-        assert(x_len >= y_len);
+        size = sizeof(limb_t) * (MOD_SCRATCH(n) + n + (m >= 0 ? m + 1 : 0));
+        t = scratch_alloc(size);
+        u = t + MOD_SCRATCH(n);
 
-        /* Copy y into w, and pad it to the same length as x. */
-        for (i = 0; i < y_len; i++) {
-                w[i] = y[i];
+        if (m >= 0) {
+                divide(m, n, x->data, mod->data, u + n, u);
+        } else {
+                zero_extend(n, u, x->length, x->data);
         }
-        for (i = y_len; i < x_len; i++) {
-                w[i] = 0;
+        if (x->negative && normalized_length(n, u) != 0) {
+                sub_n(n, mod->data, u, u);
+        }
+        if (mod->odd) {
+                mod_mul(mod, u, mod->r2, u, t);
         }
 
-        /* w = x + w */
-        algorithm_a(x_len, x, w, w);
+        z = store(dst, n, u, false);
+        scratch_free(t, size);
 
-        return bigint_create(w_len, w, false);
+        return z;
 }
 
-static bigint_t *sub(int x_len, const uint32_t *x, int y_len, const uint32_t *y)
+/* Store the least nonnegative value of the residue x over dst. */
+static bigint_t *mod_leave(bigint_t *dst, const bigint_mod_t *mod,
+                           const bigint_t *x)
 {
+        int n = mod->n;
+        size_t size = sizeof(limb_t) * 3 * n;
+        limb_t *t;
         bigint_t *z;
 
-        if (cmp(x_len, x, y_len, y) < 0) {
-                /* x - y = -(y - x) */
-                z = sub(y_len, y, x_len, x);
-                z->negative = true;
-                return z;
+        if (!mod->odd) {
+                mod_check(mod, x);
+                return store(dst, x->length, x->data, false);
         }
 
-        uint32_t w[x_len];
-        int i;
+        t = scratch_alloc(size);
+        zero_extend(2 * n, t, x->length, x->data);
+        mod_check(mod, x);
+        redc(mod, t, t + 2 * n);
+        z = store(dst, n, t + 2 * n, false);
+        scratch_free(t, size);
 
-        assert(x_len >= y_len);
+        return z;
+}
 
-        /* Copy y into w, and pad to the same length as x. */
-        for (i = 0; i < y_len; i++) {
-                w[i] = y[i];
-        }
-        for (i = y_len; i < x_len; i++) {
-                w[i] = 0;
+/* Store x + y mod N, or x - y mod N if subtract is set, over dst. */
+static bigint_t *mod_add(bigint_t *dst, const bigint_mod_t *mod,
+                         const bigint_t *x, const bigint_t *y, bool subtract)
+{
+        int n = mod->n;
+        size_t size = sizeof(limb_t) * 2 * n;
+        limb_t *u, *v;
+        bigint_t *z;
+
+        u = scratch_alloc(size);
+        v = u + n;
+        mod_load(mod, x, u);
+        mod_load(mod, y, v);
+
+        if (!subtract) {
+                if (add_n(n, u, v, u) != 0 || cmp(n, u, n, mod->data) >= 0) {
+                        sub_n(n, u, mod->data, u);
+                }
+        } else if (sub_n(n, u, v, u) != 0) {
+                add_n(n, u, mod->data, u);
         }
 
-        /* w = x - w */
-        algorithm_s(x_len, x, w, w);
+        z = store(dst, n, u, false);
+        scratch_free(u, size);
 
-        return bigint_create(x_len, w, false);
+        return z;
 }
 
-bigint_t *bigint_add(const bigint_t *x, const bigint_t *y)
+/* Store -x mod N over dst. */
+static bigint_t *mod_neg(bigint_t *dst, const bigint_mod_t *mod,
+                         const bigint_t *x)
+{
+        mod_check(mod, x);
+        if (x->length == 0) {
+                return store_small(dst, 0, false);
+        }
+
+        return sub(dst, mod->n, mod->data, x->length, x->data, false);
+}
+
+static bigint_t *mod_mul_into(bigint_t *dst, const bigint_mod_t *mod,
+                              const bigint_t *x, const bigint_t *y)
 {
+        int n = mod->n;
+        size_t size = sizeof(limb_t) * (MOD_SCRATCH(n) + 2 * n);
+        limb_t *t, *u, *v;
         bigint_t *z;
 
-        if (x->negative && y->negative) {
-                /* (-x) + (-y) = -(x + y) */
-                z = add(x->length, x->data, y->length, y->data);
-                z->negative = true;
-                return z;
-        }
+        t = scratch_alloc(size);
+        u = t + MOD_SCRATCH(n);
+        v = u + n;
+        mod_load(mod, x, u);
 
-        if (x->negative) {
-                assert(!y->negative);
-                /* (-x) + y = y - x */
-                return sub(y->length, y->data, x->length, x->data);
+        /* Equal residues make mul() square. */
+        if (x == y || (x->length == y->length &&
+                       memcmp(x->data, y->data,
+                              sizeof(x->data[0]) * x->length) == 0)) {
+                v = u;
+        } else {
+                mod_load(mod, y, v);
         }
 
-        if (y->negative) {
-                assert(!x->negative);
-                /* x + (-y) = x - y */
-                return sub(x->length, x->data, y->length, y->data);
-        }
+        mod_mul(mod, u, v, u, t);
+        z = store(dst, n, u, false);
+        scratch_free(t, size);
 
-        assert(!x->negative && !y->negative);
+        return z;
+}
 
-        return add(x->length, x->data, y->length, y->data);
+/* Get bit i of x. */
+static int get_bit(const bigint_t *x, uint64_t i)
+{
+        return x->data[i / LIMB_BITS] >> (i % LIMB_BITS) & 1;
 }
 
-bigint_t *bigint_sub(const bigint_t *x, const bigint_t *y)
+/*
+   Raise the residue x to the power e >= 0 and store it over dst, by sliding
+   windows as in power_window(). As e may be of any length, so may the
+   windows be: k bits take 2**(k - 1) products to tabulate the odd powers,
+   and save about bits(e) / (k + 1) - bits(e) / (k + 2) of them by shortening
+   the rest, so k grows with the length of e.
+ */
+static bigint_t *mod_pow(bigint_t *dst, const bigint_mod_t *mod,
+                         const bigint_t *x, const bigint_t *e)
 {
+        int n = mod->n, k, count, j;
+        int64_t i, l, bits;
+        size_t size;
+        limb_t *t, *w, *table, *sq;
+        unsigned val;
         bigint_t *z;
 
-        if (x->negative && y->negative) {
-                /* (-x) - (-y) = y - x */
-                return sub(y->length, y->data, x->length, x->data);
+        assert(!e->negative && "Negative exponent!");
+
+        if (e->length == 0) {
+                mod_check(mod, x);
+                return store(dst, n, mod->one, false);
         }
 
-        if (x->negative) {
-                assert(!y->negative);
-                /* (-x) - y = -(x + y) */
-                z = add(x->length, x->data, y->length, y->data);
-                z->negative = true;
-                return z;
+        bits = (int64_t)bit_length(e->length, e->data);
+        k = bits < 8 ? 1 : bits < 24 ? 2 : bits < 80 ? 3 : bits < 240 ? 4 :
+            bits < 672 ? 5 : 6;
+        count = 1 << (k - 1);
+
+        /* The odd powers x**(2j + 1), j < count, with x**2 after them. */
+        size = sizeof(limb_t) * (MOD_SCRATCH(n) + n + (count + 1) * n);
+        t = scratch_alloc(size);
+        w = t + MOD_SCRATCH(n);
+        table = w + n;
+        sq = table + (size_t)count * n;
+        mod_load(mod, x, table);
+        if (k > 1) {
+                mod_mul(mod, table, table, sq, t);
+                for (j = 1; j < count; j++) {
+                        mod_mul(mod, table + (size_t)(j - 1) * n, sq,
+                                table + (size_t)j * n, t);
+                }
         }
 
-        if (y->negative) {
-                assert(!x->negative);
-                /* x - (-y) = x + y */
-                return add(x->length, x->data, y->length, y->data);
+        /* The top bit of e is one, so w is set by the first window. */
+        for (i = bits - 1; i >= 0; i = l - 1) {
+                if (get_bit(e, i) == 0) {
+                        mod_mul(mod, w, w, w, t);
+                        l = i;
+                        continue;
+                }
+
+                /* The window e[i..l], which ends in a one. */
+                l = i - k + 1 < 0 ? 0 : i - k + 1;
+                while (get_bit(e, l) == 0) {
+                        l++;
+                }
+                val = 0;
+                for (j = 0; j <= i - l; j++) {
+                        val = val << 1 | get_bit(e, i - j);
+                }
+
+                if (i == bits - 1) {
+                        memcpy(w, table + (size_t)(val / 2) * n,
+                               sizeof(w[0]) * n);
+                        continue;
+                }
+                for (j = 0; j <= i - l; j++) {
+                        mod_mul(mod, w, w, w, t);
+                }
+                mod_mul(mod, w, table + (size_t)(val / 2) * n, w, t);
         }
 
-        assert(!x->negative && !y->negative);
+        z = store(dst, n, w, false);
+        scratch_free(t, size);
 
-        return sub(x->length, x->data, y->length, y->data);
+        return z;
 }
 
-bigint_t *bigint_mul(const bigint_t *x, const bigint_t *y)
+bigint_t *bigint_mod_enter_into(bigint_t *dst, const bigint_mod_t *mod,
+                                const bigint_t *x)
 {
-        uint32_t w[x->length + y->length];
+        uint64_t start = stat_start();
+        uint32_t len = x->length;
 
-        algorithm_m(x->length, y->length, x->data, y->data, w);
+        dst = mod_enter(dst, mod, x);
+        stat_stop(STAT_MOD, start, len);
 
-        return bigint_create(x->length + y->length, w,
-                             x->negative ^ y->negative);
+        return dst;
 }
 
-static bigint_t *divrem(int x_len, const uint32_t *x,
-                        int y_len, const uint32_t *y,
-                        bool remainder)
+bigint_t *bigint_mod_leave_into(bigint_t *dst, const bigint_mod_t *mod,
+                                const bigint_t *x)
 {
-        uint32_t q[x_len - y_len + 1];
-        uint32_t r[y_len];
+        uint64_t start = stat_start();
 
-        assert(x_len >= y_len);
+        dst = mod_leave(dst, mod, x);
+        stat_stop(STAT_MOD, start, mod->n);
 
-        algorithm_d_wrapper(x_len - y_len, y_len, x, y, q, r);
+        return dst;
+}
 
-        if (remainder) {
-                return bigint_create(y_len, r, false);
-        }
+bigint_t *bigint_modadd_into(bigint_t *dst, const bigint_mod_t *mod,
+                             const bigint_t *x, const bigint_t *y)
+{
+        uint64_t start = stat_start();
 
-        return bigint_create(x_len - y_len + 1, q, false);
+        dst = mod_add(dst, mod, x, y, false);
+        stat_stop(STAT_MOD, start, mod->n);
+
+        return dst;
 }
 
-bigint_t *bigint_div(const bigint_t *x, const bigint_t *y)
+bigint_t *bigint_modsub_into(bigint_t *dst, const bigint_mod_t *mod,
+                             const bigint_t *x, const bigint_t *y)
 {
-        bigint_t *z;
+        uint64_t start = stat_start();
 
-        if (x->length < y->length) {
-                return bigint_create(0, NULL, false);
-        }
+        dst = mod_add(dst, mod, x, y, true);
+        stat_stop(STAT_MOD, start, mod->n);
 
-        z = divrem(x->length, x->data, y->length, y->data, false);
-        z->negative = x->negative ^ y->negative;
+        return dst;
+}
 
-        return z;
+bigint_t *bigint_modneg_into(bigint_t *dst, const bigint_mod_t *mod,
+                             const bigint_t *x)
+{
+        uint64_t start = stat_start();
+
+        dst = mod_neg(dst, mod, x);
+        stat_stop(STAT_MOD, start, mod->n);
+
+        return dst;
 }
 
-bigint_t *bigint_rem(const bigint_t *x, const bigint_t *y)
+bigint_t *bigint_modmul_into(bigint_t *dst, const bigint_mod_t *mod,
+                             const bigint_t *x, const bigint_t *y)
 {
-        bigint_t *z;
+        uint64_t start = stat_start();
 
-        if (x->length < y->length) {
-                z = bigint_create(x->length, x->data, false);
-        } else {
-                z = divrem(x->length, x->data, y->length, y->data, true);
-        }
+        dst = mod_mul_into(dst, mod, x, y);
+        stat_stop(STAT_MODMUL, start, mod->n);
 
-        z->negative = x->negative;
+        return dst;
+}
 
-        return z;
+bigint_t *bigint_modpow_into(bigint_t *dst, const bigint_mod_t *mod,
+                             const bigint_t *x, const bigint_t *e)
+{
+        uint64_t start = stat_start();
+
+        dst = mod_pow(dst, mod, x, e);
+        stat_stop(STAT_MODPOW, start, mod->n);
+
+        return dst;
 }
 
-bigint_t *bigint_neg(const bigint_t *x)
+bigint_t *bigint_mod_enter(const bigint_mod_t *mod, const bigint_t *x)
 {
-        return bigint_create(x->length, x->data, x->negative ^ 1);
+        return bigint_mod_enter_into(NULL, mod, x);
 }
 
-int bigint_cmp(const bigint_t *x, const bigint_t *y)
+bigint_t *bigint_mod_leave(const bigint_mod_t *mod, const bigint_t *x)
 {
-        if (x->negative != y->negative) {
-                return x->negative ? -1 : 1;
-        }
+        return bigint_mod_leave_into(NULL, mod, x);
+}
 
-        assert(x->negative == y->negative);
+bigint_t *bigint_modadd(const bigint_mod_t *mod, const bigint_t *x,
+                        const bigint_t *y)
+{
+        return bigint_modadd_into(NULL, mod, x, y);
+}
 
-        if (x->negative) {
-                return cmp(y->length, y->data, x->length, x->data);
-        }
+bigint_t *bigint_modsub(const bigint_mod_t *mod, const bigint_t *x,
+                        const bigint_t *y)
+{
+        return bigint_modsub_into(NULL, mod, x, y);
+}
 
-        return cmp(x->length, x->data, y->length, y->data);
+bigint_t *bigint_modneg(const bigint_mod_t *mod, const bigint_t *x)
+{
+        return bigint_modneg_into(NULL, mod, x);
 }
 
-bool bigint_is_zero(const bigint_t *x)
+bigint_t *bigint_modmul(const bigint_mod_t *mod, const bigint_t *x,
+                        const bigint_t *y)
 {
-        return x->length == 0;
-}
\ No newline at end of file
+        return bigint_modmul_into(NULL, mod, x, y);
+}
+
+bigint_t *bigint_modpow(const bigint_mod_t *mod, const bigint_t *x,
+                        const bigint_t *e)
+{
+        return bigint_modpow_into(NULL, mod, x, e);
+}
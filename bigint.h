@@ -4,8 +4,48 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 typedef struct bigint_t bigint_t;
+typedef struct bigint_ctx_t bigint_ctx_t;
+
+/* Scratch contexts. The arithmetic functions take their temporary buffers
+   from a pool in the calling thread's context and keep them there for reuse.
+   Each thread starts out with a default context of its own, whose buffers are
+   kept for the lifetime of the thread, so the functions below may be called
+   from several threads at once. */
+bigint_ctx_t *bigint_ctx_create(void);
+void bigint_ctx_destroy(bigint_ctx_t *ctx);
+
+/* Make the calling thread use ctx, or its default context if ctx is NULL.
+   Returns the previously used context, or NULL for the default. */
+bigint_ctx_t *bigint_ctx_use(bigint_ctx_t *ctx);
+
+/* Use threads threads for each large multiplication and conversion; 1 keeps
+   them on the calling thread, as at startup. Not to be called while any
+   other bigint function is running. */
+void bigint_set_threads(int threads);
+
+/* Statistics. While enabled, the conversions and arithmetic functions below
+   are counted and timed by operation, with a histogram of their operand
+   sizes, and so are the blocks and bytes they allocate. The counts are
+   summed over all threads. bigint_print_stats() writes a table of them to f.
+   Enabling is not to be done while any other bigint function is running. */
+void bigint_set_stats(bool enable);
+void bigint_print_stats(FILE *f);
+
+/* Memory. Every bigint is a single block from the allocator, which is
+   malloc(), realloc() and free() until bigint_set_allocator() changes it.
+   The three are given together, as one allocator's, or all NULL to restore
+   the default. alloc and resize must return NULL only when out of memory, on
+   which the library exits. The library keeps no bigint storage past the call
+   that made it, so an arena can be dropped all at once when its bigints are
+   no longer used. The allocator is to be set before any bigint exists.
+   Release bigints with bigint_free(), which accepts NULL. */
+void bigint_set_allocator(void *(*alloc)(size_t),
+                          void *(*resize)(void *, size_t),
+                          void (*release)(void *));
+void bigint_free(bigint_t *x);
 
 /* Create a bigint from n-length array u. Leading zeros or n = 0 are allowed. */
 bigint_t *bigint_create(int n, const uint32_t *u, bool negative);
@@ -14,17 +54,49 @@ bigint_t *bigint_create(int n, const uint32_t *u, bool negative);
    decimal characters, with an optional preceding hyphen. */
 bigint_t *bigint_create_str(int n, const char *str);
 
+/* Create a bigint from n-character string str of hex digits, in either case,
+   with an optional preceding hyphen and "0x" prefix. */
+bigint_t *bigint_create_hex(int n, const char *str);
+
+/* Create a bigint with magnitude the n bytes at data, least significant
+   first: the raw little-endian format, as a little-endian machine stores an
+   array of limbs. */
+bigint_t *bigint_create_raw(size_t n, const void *data, bool negative);
+
+/* Get the number of bytes that bigint_export_raw() writes for x: none for
+   zero, and no leading zero bytes otherwise. */
+size_t bigint_raw_size(const bigint_t *x);
+
+/* Write the magnitude of x to data in the raw format, and return whether x
+   is negative. */
+bool bigint_export_raw(const bigint_t *x, void *data);
+
 /* Get the maximum required string length for x. */
 size_t bigint_max_stringlen(const bigint_t *x);
 
 /* Convert bigint to decimal string. */
 void bigint_tostring(const bigint_t *x, char *str);
 
-/* Print a bigint to stdout in decimal. */
+/* Get the maximum required string length for x in hex. */
+size_t bigint_max_hexlen(const bigint_t *x);
+
+/* Convert bigint to a hex string, such as "-0x1f", in linear time. */
+void bigint_tohex(const bigint_t *x, char *str);
+
+/* Print a bigint to stdout in decimal, followed by a newline. */
 void bigint_print(const bigint_t *x);
 
+/* Write a bigint in decimal to f, or to file descriptor fd, a block at a
+   time as the digits are produced, so that the memory used does not grow
+   with the length of the output. Returns 0, or EOF on a write error. */
+int bigint_fprint(FILE *f, const bigint_t *x);
+int bigint_write(int fd, const bigint_t *x);
+
+/* Write a bigint to f in hex, as by bigint_tohex(). */
+int bigint_fprint_hex(FILE *f, const bigint_t *x);
+
 /* Arithmetic. Division does truncation towards zero, and the remainder will
-   have the same sign as the divisor. Division by zero is not allowed. */
+   have the same sign as the dividend. Division by zero is not allowed. */
 bigint_t *bigint_add(const bigint_t *x, const bigint_t *y);
 bigint_t *bigint_sub(const bigint_t *x, const bigint_t *y);
 bigint_t *bigint_mul(const bigint_t *x, const bigint_t *y);
@@ -32,6 +104,97 @@ bigint_t *bigint_div(const bigint_t *x, const bigint_t *y);
 bigint_t *bigint_rem(const bigint_t *x, const bigint_t *y);
 bigint_t *bigint_neg(const bigint_t *x);
 
+/* Square x. bigint_mul() also notices equal magnitudes, and both use
+   squaring kernels that save up to half the work of a general product. */
+bigint_t *bigint_sqr(const bigint_t *x);
+
+/* Raise x to the power e, where x**0 = 1 for any x, including zero. The
+   result must fit in a bigint. Powers of two are computed by shifting. */
+bigint_t *bigint_pow(const bigint_t *x, uint64_t e);
+
+/* Shift x left or right by n bits, which is to multiply or divide it by 2**n.
+   The sign is kept, and bigint_shr() truncates towards zero as bigint_div()
+   does. bigint_mul(), bigint_div() and bigint_rem() use the shifts whenever an
+   operand is a power of two. */
+bigint_t *bigint_shl(const bigint_t *x, uint64_t n);
+bigint_t *bigint_shr(const bigint_t *x, uint64_t n);
+
+/* The same operations, storing the result over dst instead of in a new
+   bigint. dst may be NULL, or one of the operands, as in x = x + y. If dst is
+   too small to hold the result, it is freed and a new bigint is returned in
+   its place; otherwise dst itself is returned. */
+bigint_t *bigint_add_into(bigint_t *dst, const bigint_t *x, const bigint_t *y);
+bigint_t *bigint_sub_into(bigint_t *dst, const bigint_t *x, const bigint_t *y);
+bigint_t *bigint_mul_into(bigint_t *dst, const bigint_t *x, const bigint_t *y);
+bigint_t *bigint_div_into(bigint_t *dst, const bigint_t *x, const bigint_t *y);
+bigint_t *bigint_rem_into(bigint_t *dst, const bigint_t *x, const bigint_t *y);
+bigint_t *bigint_neg_into(bigint_t *dst, const bigint_t *x);
+bigint_t *bigint_sqr_into(bigint_t *dst, const bigint_t *x);
+bigint_t *bigint_pow_into(bigint_t *dst, const bigint_t *x, uint64_t e);
+bigint_t *bigint_shl_into(bigint_t *dst, const bigint_t *x, uint64_t n);
+bigint_t *bigint_shr_into(bigint_t *dst, const bigint_t *x, uint64_t n);
+
+/* Divide x by y as by bigint_div and bigint_rem, but with a single division,
+   storing the quotient in *q and the remainder in *r. Either of q and r may be
+   NULL if that result is not needed. */
+void bigint_divrem(const bigint_t *x, const bigint_t *y,
+                   bigint_t **q, bigint_t **r);
+
+/* Modular arithmetic. A bigint_mod_t holds a modulus N > 0 with what is
+   precomputed for multiplying modulo it, and may be shared between threads.
+   The functions below work on residues, from 0 to N - 1, in a form of the
+   modulus's own: the Montgomery form x * 2**k mod N for odd N, in which
+   products need no division, and x itself for even N. bigint_mod_enter()
+   takes any x to its residue, and bigint_mod_leave() gives back the value
+   from 0 to N - 1 a residue stands for, so a computation converts only on
+   the way in and out. bigint_modpow() takes an exponent e >= 0 of any
+   size; x**0 is 1 for any x, including zero. */
+typedef struct bigint_mod_t bigint_mod_t;
+
+bigint_mod_t *bigint_mod_create(const bigint_t *n);
+void bigint_mod_destroy(bigint_mod_t *mod);
+
+bigint_t *bigint_mod_enter(const bigint_mod_t *mod, const bigint_t *x);
+bigint_t *bigint_mod_leave(const bigint_mod_t *mod, const bigint_t *x);
+bigint_t *bigint_modadd(const bigint_mod_t *mod, const bigint_t *x,
+                        const bigint_t *y);
+bigint_t *bigint_modsub(const bigint_mod_t *mod, const bigint_t *x,
+                        const bigint_t *y);
+bigint_t *bigint_modneg(const bigint_mod_t *mod, const bigint_t *x);
+bigint_t *bigint_modmul(const bigint_mod_t *mod, const bigint_t *x,
+                        const bigint_t *y);
+bigint_t *bigint_modpow(const bigint_mod_t *mod, const bigint_t *x,
+                        const bigint_t *e);
+
+/* The same, storing over dst as the _into functions above do. */
+bigint_t *bigint_mod_enter_into(bigint_t *dst, const bigint_mod_t *mod,
+                                const bigint_t *x);
+bigint_t *bigint_mod_leave_into(bigint_t *dst, const bigint_mod_t *mod,
+                                const bigint_t *x);
+bigint_t *bigint_modadd_into(bigint_t *dst, const bigint_mod_t *mod,
+                             const bigint_t *x, const bigint_t *y);
+bigint_t *bigint_modsub_into(bigint_t *dst, const bigint_mod_t *mod,
+                             const bigint_t *x, const bigint_t *y);
+bigint_t *bigint_modneg_into(bigint_t *dst, const bigint_mod_t *mod,
+                             const bigint_t *x);
+bigint_t *bigint_modmul_into(bigint_t *dst, const bigint_mod_t *mod,
+                             const bigint_t *x, const bigint_t *y);
+bigint_t *bigint_modpow_into(bigint_t *dst, const bigint_mod_t *mod,
+                             const bigint_t *x, const bigint_t *e);
+
+/* Binary files, holding a bigint in a form that can be used straight from
+   memory. bigint_save() writes x to path, returning 0 or EOF on failure.
+   bigint_map() maps the file at path read-only, or copies it if the machine
+   cannot use it in place, and returns NULL with errno set on failure. The
+   value stays valid until bigint_unmap(), and must not be freed or used as
+   the destination of an _into function. */
+typedef struct bigint_file_t bigint_file_t;
+
+int bigint_save(const char *path, const bigint_t *x);
+bigint_file_t *bigint_map(const char *path);
+const bigint_t *bigint_file_value(const bigint_file_t *file);
+void bigint_unmap(bigint_file_t *file);
+
 /* Comparison: returns -1 if x < y, 1 if x > y, and 0 if they are equal. */
 int bigint_cmp(const bigint_t *x, const bigint_t *y);
 
@@ -1,23 +1,60 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "bigint.h"
+#include "pool.h"
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 
-enum token_kind { ADD, SUB, MUL, DIV, LP, RP, NUM, EOL, END };
+enum token_kind { ADD, SUB, MUL, DIV, POW, LP, RP, NUM, EOL, END };
 
 struct token_t {
         enum token_kind kind;
         bigint_t *value;
+        size_t hash;            /* Hash of the digits of a NUM. */
+        bool borrowed;          /* Whether value belongs to an @file
+                                   operand or a kept result. */
 };
 
-static struct token_t current_token;
+static _Thread_local struct token_t current_token;
+
+/* FNV-1a hashing, for numbers and expression trees. */
+#define HASH_INIT ((size_t)14695981039346656037u)
+
+static size_t hash_mix(size_t h, size_t x)
+{
+        return (h ^ x) * (size_t)1099511628211u;
+}
+
+/* In batch mode, an error ends the worker's job rather than the program, and
+   is reported once the output of the lines before it has been written. */
+static _Thread_local jmp_buf *error_jump;
+static _Thread_local char error_message[256];
 
 static void error(const char *msg, ...)
 {
         va_list ap;
 
         va_start(ap, msg);
+        if (error_jump != NULL) {
+                vsnprintf(error_message, sizeof(error_message), msg, ap);
+                va_end(ap);
+                longjmp(*error_jump, 1);
+        }
         fputs("error: ", stderr);
         vfprintf(stderr, msg, ap);
         fputc('\n', stderr);
@@ -26,201 +63,2289 @@ static void error(const char *msg, ...)
         exit(1);
 }
 
-#define BUFFER_SIZE (100*1024)
-static char buffer[BUFFER_SIZE];
+static void *xmalloc(size_t n)
+{
+        void *p = malloc(n);
+
+        if (p == NULL) {
+                error("out of memory!");
+        }
+
+        return p;
+}
+
+static void *xrealloc(void *p, size_t n)
+{
+        p = realloc(p, n);
+        if (p == NULL) {
+                error("out of memory!");
+        }
+
+        return p;
+}
+
+/*
+   Input is read in large blocks into a buffer that grows to hold the longest
+   token, or mapped whole when stdin is a regular file, so that numbers can be
+   passed to bigint_create_str where they lie. Bytes from input.pos on are
+   unconsumed. Input is read from input.fd, which is stdin except for the
+   connections of --listen.
+ */
+#define BLOCK_SIZE (1024*1024)
+
+static struct {
+        char *data;
+        size_t pos, len, size;
+        bool started, mapped, eof;
+        int fd;
+} input = {.fd = STDIN_FILENO};
+
+/* Try mapping stdin. Returns false if it is not a regular file. */
+static bool map_input(void)
+{
+        struct stat st;
+        void *p;
+
+        if (fstat(STDIN_FILENO, &st) != 0 || !S_ISREG(st.st_mode) ||
+            st.st_size <= 0 || (uintmax_t)st.st_size > SIZE_MAX) {
+                return false;
+        }
+
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+        if (p == MAP_FAILED) {
+                return false;
+        }
+
+        input.data = p;
+        input.len = st.st_size;
+        input.mapped = true;
+
+        return true;
+}
+
+/* Read more input, keeping the unconsumed bytes. Returns false at the end. */
+static bool refill(void)
+{
+        ssize_t n;
+
+        if (!input.started) {
+                input.started = true;
+                if (map_input()) {
+                        return true;
+                }
+        }
+
+        if (input.mapped || input.eof) {
+                return false;
+        }
+
+        /* Move the unconsumed bytes to the front, and grow the buffer if they
+           fill it. */
+        if (input.pos > 0) {
+                memmove(input.data, input.data + input.pos,
+                        input.len - input.pos);
+                input.len -= input.pos;
+                input.pos = 0;
+        }
+        if (input.len == input.size) {
+                input.size = input.size ? 2 * input.size : BLOCK_SIZE;
+                input.data = realloc(input.data, input.size);
+                if (input.data == NULL) {
+                        error("out of memory!");
+                }
+        }
+
+        do {
+                n = read(input.fd, input.data + input.len,
+                         input.size - input.len);
+        } while (n < 0 && errno == EINTR);
+
+        if (n < 0) {
+                error("read failed: %s", strerror(errno));
+        }
+        if (n == 0) {
+                input.eof = true;
+                return false;
+        }
+
+        input.len += n;
+
+        return true;
+}
+
+/* In batch mode, the text being tokenized: the lines of a job. */
+static _Thread_local struct {
+        const char *pos, *end;
+} text;
+
+/* Get the i-th unconsumed input character, or EOF. */
+static int peek(size_t i)
+{
+        if (text.pos != NULL) {
+                if (i >= (size_t)(text.end - text.pos)) {
+                        return EOF;
+                }
+                return (unsigned char)text.pos[i];
+        }
+
+        while (input.len - input.pos <= i) {
+                if (!refill()) {
+                        return EOF;
+                }
+        }
+
+        return (unsigned char)input.data[input.pos + i];
+}
+
+/* Get the unconsumed input. Only valid up to the last character peeked. */
+static const char *cursor(void)
+{
+        return text.pos != NULL ? text.pos : input.data + input.pos;
+}
+
+/* Consume n characters. */
+static void advance(size_t n)
+{
+        if (text.pos != NULL) {
+                text.pos += n;
+        } else {
+                input.pos += n;
+        }
+}
+
+/*
+   Files given as @path operands are mapped once, for the rest of the run,
+   and their values used in place. The list is shared by the threads of
+   batch mode.
+ */
+static struct mapped_file {
+        char *path;
+        bigint_file_t *file;
+        struct mapped_file *next;
+} *mapped_files;
+
+static pthread_mutex_t mapped_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bigint_t *map_operand(size_t len, const char *name)
+{
+        struct mapped_file *m;
+        char *path;
+        int err = ENOMEM;
+
+        path = malloc(len + 1);
+        if (path == NULL) {
+                error("out of memory!");
+        }
+        memcpy(path, name, len);
+        path[len] = '\0';
+
+        pthread_mutex_lock(&mapped_lock);
+        for (m = mapped_files; m != NULL; m = m->next) {
+                if (strcmp(m->path, path) == 0) {
+                        break;
+                }
+        }
+        if (m == NULL && (m = malloc(sizeof(*m))) != NULL) {
+                m->path = path;
+                m->file = bigint_map(path);
+                if (m->file != NULL) {
+                        m->next = mapped_files;
+                        mapped_files = m;
+                        path = NULL;
+                } else {
+                        err = errno;
+                        free(m);
+                        m = NULL;
+                }
+        }
+        pthread_mutex_unlock(&mapped_lock);
+
+        if (m == NULL) {
+                error("%s: %s", path, strerror(err));
+        }
+        free(path);
+
+        /* Never written to or freed: see NODE_REF. */
+        return (bigint_t *)bigint_file_value(m->file);
+}
+
+/*
+   Sessions, with --repl or --listen: lines are answered one at a time as
+   they arrive, and each result is kept as $1, $2, ... for later lines,
+   which can also bind one to a name with let. The last HISTORY results are
+   kept, along with any bound to names. Results are shared with the cache of
+   session_answer(), so each is counted by its references.
+ */
+#ifndef HISTORY
+#define HISTORY 4096
+#endif
+
+struct result {
+        bigint_t *value;
+        unsigned long number;   /* k, for $k. */
+        int refs;
+};
+
+struct binding {
+        char *name;
+        struct result *result;
+        struct binding *next;
+};
+
+static bool session;
+static struct result *history[HISTORY];        /* $k at k % HISTORY. */
+static unsigned long results;                   /* Results so far. */
+static struct binding *bindings;
+
+static void drop_result(struct result *r)
+{
+        if (r != NULL && --r->refs == 0) {
+                bigint_free(r->value);
+                free(r);
+        }
+}
+
+/* Get $k, or NULL if there is no such result any more. */
+static struct result *find_result(unsigned long k)
+{
+        if (k == 0 || k > results || results - k >= HISTORY) {
+                return NULL;
+        }
+
+        return history[k % HISTORY];
+}
+
+static struct binding *find_binding(const char *name, size_t len)
+{
+        struct binding *b;
+
+        for (b = bindings; b != NULL; b = b->next) {
+                if (strncmp(b->name, name, len) == 0 && b->name[len] == '\0') {
+                        break;
+                }
+        }
+
+        return b;
+}
+
+/* Check whether c can start a name, or be part of one after that. */
+static bool name_start(int c)
+{
+        return isalpha(c) || c == '_';
+}
+
+static bool name_char(int c)
+{
+        return isalnum(c) || c == '_';
+}
+
+/* Make the current token the kept result r, if there is one. */
+static void result_token(const struct result *r, size_t len, const char *str)
+{
+        if (r == NULL) {
+                error("no such result: %.*s", (int)len, str);
+        }
+
+        current_token.kind = NUM;
+        current_token.value = r->value;
+        current_token.hash = hash_mix(hash_mix(HASH_INIT, '$'), r->number);
+        current_token.borrowed = true;
+        advance(len);
+}
 
 static void next_token(void)
 {
+        struct binding *b;
+        unsigned long k;
         int c;
         size_t len;
+        bool hex;
 
         assert(current_token.kind != END && "Can't get token after END!");
 
-        do {
-                c = getchar();
-        } while (c == ' ' || c == '\t');
+        while ((c = peek(0)) == ' ' || c == '\t') {
+                advance(1);
+        }
 
         switch (c) {
         case '+':
                 current_token.kind = ADD;
-                return;
+                break;
         case '-':
                 current_token.kind = SUB;
-                return;
+                break;
         case '*':
                 current_token.kind = MUL;
-                return;
+                break;
         case '/':
                 current_token.kind = DIV;
-                return;
+                break;
+        case '^':
+                current_token.kind = POW;
+                break;
         case '(':
                 current_token.kind = LP;
-                return;
+                break;
         case ')':
                 current_token.kind = RP;
-                return;
+                break;
         case '\n':
                 current_token.kind = EOL;
-                return;
+                break;
         case EOF:
                 current_token.kind = END;
                 return;
-        }
+        case '@':
+                /* A binary file, whose path runs to the next blank, newline,
+                   '+', '*', '^' or parenthesis; '-' and '/' are part of it. */
+                len = 1;
+                current_token.hash = hash_mix(HASH_INIT, c);
+                while ((c = peek(len)) != EOF &&
+                       strchr(" \t\n+*^()", c) == NULL) {
+                        current_token.hash = hash_mix(current_token.hash, c);
+                        len++;
+                }
+                if (len == 1) {
+                        error("expected file name after '@'");
+                }
+
+                current_token.kind = NUM;
+                current_token.value = map_operand(len - 1, cursor() + 1);
+                current_token.borrowed = true;
+                advance(len);
+                return;
+        case '$':
+                /* $k, the k-th result of the session. */
+                k = 0;
+                for (len = 1; session && isdigit(c = peek(len)); len++) {
+                        k = k < ULONG_MAX / 10 ? 10 * k + (c - '0') :
+                            ULONG_MAX;
+                }
+                if (len == 1) {
+                        error("unexpected character: '$'");
+                }
+                result_token(find_result(k), len, cursor());
+                return;
+        default:
+                if (session && name_start(c)) {
+                        for (len = 1; name_char(peek(len)); len++) {
+                        }
+                        b = find_binding(cursor(), len);
+                        result_token(b ? b->result : NULL, len, cursor());
+                        return;
+                }
 
-        len = 0;
-        while (c >= '0' && c <= '9') {
-                if (len == BUFFER_SIZE) {
+                /* A hex literal, 0x followed by hex digits, or decimal. */
+                hex = (c == '0' && (peek(1) == 'x' || peek(1) == 'X') &&
+                       isxdigit(peek(2)));
+                len = hex ? 2 : 0;
+                current_token.hash = HASH_INIT;
+                while (hex ? isxdigit(c = peek(len)) :
+                       (c = peek(len)) >= '0' && c <= '9') {
+                        current_token.hash = hash_mix(current_token.hash, c);
+                        len++;
+                }
+                if (len == 0) {
+                        error("unexpected character: '%c'", peek(0));
+                }
+                if (len > INT_MAX) {
                         error("number too long!");
                 }
 
-                buffer[len++] = c;
-                c = getchar();
-        }
-        if (len > 0) {
-                ungetc(c, stdin);
                 current_token.kind = NUM;
-                current_token.value = bigint_create_str(len, buffer);
+                current_token.value = hex ? bigint_create_hex(len, cursor()) :
+                                      bigint_create_str(len, cursor());
+                current_token.borrowed = false;
+                advance(len);
                 return;
         }
 
-        error("unexpected character: '%c'", c);
+        advance(1);
 }
 
 /*
-   Grammar:
+   Each line is parsed into a tree of nodes first and evaluated afterwards.
+   With --cse, identical subtrees are shared through a hash table, so that
+   each distinct subexpression is evaluated only once.
 
-   <expr>   ::= <sum> EOL | END
-   <sum>    ::= <term> (ADD <term> | SUB <term>)*
-   <term>   ::= <factor> (MUL <factor> | DIV <factor>)*
-   <factor> ::= SUB <factor> | LP <sum> RP | <number>
+   uses counts the references to a node. Evaluation consumes them, and a
+   node's value is freed, or taken over as the destination of its parent's
+   result, after the last one. A NODE_REF is a literal whose value belongs
+   elsewhere, to a mapped file or a result kept by a session, and is left
+   alone.
 
-   The functions below parse a string of tokens according to the grammar and
-   return the corresponding bigint value. expr() leaves the last token
-   unconsumed to avoid blocking on input.
-*/
+   With --mod N, the nodes are reduced: their values are residues modulo N,
+   kept in the form of bigint_mod_enter(), so that no intermediate grows
+   past N. Exponents are the exception, since x**e mod N depends on all of
+   e, so the right operand of a power and everything under it is left as
+   it is. The value of a line is brought out of that form once evaluated.
+ */
+enum node_kind {
+        NODE_NUM, NODE_REF, NODE_NEG, NODE_ADD, NODE_SUB, NODE_MUL, NODE_DIV,
+        NODE_POW
+};
+
+struct node {
+        enum node_kind kind;
+        struct node *left, *right;      /* Operands; NEG only has left. */
+        bigint_t *value;                /* Literal, or result once evaluated. */
+        int uses;
+        size_t hash;
+        struct node *chain;             /* Next node in the same bucket. */
+        struct node *next;              /* Next node of the current line. */
+        struct node *up;                /* Parent while evaluating. */
+        size_t limbs;                   /* Estimated size of the value. */
+        double cost;                    /* Estimated work to evaluate. */
+        struct eval_task *task;         /* Right operand being evaluated on
+                                           another thread, for a DIV. */
+        bool reduced;                   /* Whether value is a residue. */
+};
+
+static bool cse;
+static bool hex_output;
+static bigint_mod_t *modulus;           /* N, for --mod. */
+static size_t modulus_limbs;
+static _Thread_local bool in_exponent;  /* Whether the nodes being parsed
+                                           are under an exponent. */
+static _Thread_local struct node *nodes;
+static _Thread_local struct node **table;
+static _Thread_local size_t table_size, table_count;
 
-static bigint_t *expr(void);
-static bigint_t *sum(void);
-static bigint_t *term(void);
-static bigint_t *factor(void);
+/*
+   Cost model for evaluating on several threads, in 32-bit words: adding
+   values of n and m words takes about max(n, m) word operations, and
+   multiplying or dividing them about n * m. That overestimates large
+   products, but only decides whether a subtree is big enough to outweigh
+   handing it to another thread.
+ */
+#ifndef PARALLEL_COST
+#define PARALLEL_COST 100000.0
+#endif
 
-static bigint_t *expr(void)
+/* Get y as an exponent in *e, if it is one that fits. */
+static bool exponent(const bigint_t *y, uint64_t *e)
 {
-        bigint_t *res;
+        unsigned char bytes[8];
+        int i;
 
-        if (current_token.kind == END) {
-                return NULL;
+        if (bigint_raw_size(y) > sizeof(bytes)) {
+                return false;
         }
 
-        res = sum();
+        memset(bytes, 0, sizeof(bytes));
+        if (bigint_export_raw(y, bytes)) {
+                return false;
+        }
 
-        if (current_token.kind != EOL) {
-                error("trailing character(s)");
+        *e = 0;
+        for (i = sizeof(bytes) - 1; i >= 0; i--) {
+                *e = *e << 8 | bytes[i];
         }
 
-        return res;
+        return true;
 }
 
-static bigint_t *sum(void)
+static void estimate(struct node *n)
 {
-        bigint_t *x, *y, *t;
+        const struct node *l = n->left, *r = n->right;
+        double size;
+        uint64_t e;
 
-        x = term();
+        switch (n->kind) {
+        case NODE_NUM:
+        case NODE_REF:
+                n->limbs = bigint_max_stringlen(n->value) / 9 + 1;
+                n->cost = 0;
+                break;
+        case NODE_NEG:
+                n->limbs = l->limbs;
+                n->cost = l->cost + l->limbs;
+                break;
+        case NODE_ADD:
+        case NODE_SUB:
+                n->limbs = (l->limbs > r->limbs ? l->limbs : r->limbs) + 1;
+                n->cost = l->cost + r->cost + n->limbs;
+                break;
+        case NODE_MUL:
+                n->limbs = l->limbs + r->limbs;
+                n->cost = l->cost + r->cost + (double)l->limbs * r->limbs;
+                break;
+        case NODE_DIV:
+                n->limbs = l->limbs > r->limbs ? l->limbs - r->limbs + 1 : 1;
+                n->cost = l->cost + r->cost + (double)n->limbs * r->limbs +
+                          l->limbs;
+                break;
+        case NODE_POW:
+                /* Unless the exponent is a literal, guess it is small. The
+                   last squaring dominates. */
+                e = 2;
+                if (r->kind == NODE_NUM && !exponent(r->value, &e)) {
+                        e = UINT64_MAX;
+                }
+                size = (double)l->limbs * e;
+                n->limbs = size < SIZE_MAX / 2 ? (size_t)size : SIZE_MAX / 2;
+                n->cost = l->cost + r->cost + size * size / 4;
+                break;
+        }
 
-        while (true) {
-                if (current_token.kind == ADD) {
-                        next_token();
-                        y = term();
-                        t = bigint_add(x, y);
-                        free(x);
-                        free(y);
-                        x = t;
-                } else if (current_token.kind == SUB) {
-                        next_token();
-                        y = term();
-                        t = bigint_sub(x, y);
-                        free(x);
-                        free(y);
-                        x = t;
-                } else {
-                        break;
+        /* Residues stay at the size of N, and a power takes up to two
+           products of that size for each bit of the exponent. */
+        if (n->reduced && n->limbs > modulus_limbs) {
+                n->limbs = modulus_limbs;
+                if (n->kind == NODE_POW) {
+                        e = r->kind == NODE_NUM ?
+                            8 * bigint_raw_size(r->value) : 64;
+                        size = (double)modulus_limbs * modulus_limbs;
+                        n->cost = l->cost + r->cost + 2.0 * e * size;
                 }
         }
+}
 
-        return x;
+/* Check whether n is worth evaluating as a task of its own. Subexpressions
+   shared by --cse could be reached from two threads, so they are not. */
+static bool worth_task(const struct node *n)
+{
+        return !cse && pool_threads() > 1 && n->value == NULL &&
+               n->cost >= PARALLEL_COST;
 }
 
-static bigint_t *term(void)
+/* Double the hash table, or create it. */
+static void grow_table(void)
 {
-        bigint_t *x, *y, *t;
+        size_t size = table_size ? 2 * table_size : 1024;
+        struct node **t = xmalloc(sizeof(t[0]) * size);
+        struct node *n, *next;
+        size_t i;
 
-        x = factor();
+        memset(t, 0, sizeof(t[0]) * size);
+        for (i = 0; i < table_size; i++) {
+                for (n = table[i]; n != NULL; n = next) {
+                        next = n->chain;
+                        n->chain = t[n->hash & (size - 1)];
+                        t[n->hash & (size - 1)] = n;
+                }
+        }
 
-        while (true) {
-                if (current_token.kind == MUL) {
-                        next_token();
-                        y = factor();
-                        t = bigint_mul(x, y);
-                        free(x);
-                        free(y);
-                        x = t;
-                } else if (current_token.kind == DIV) {
-                        next_token();
-                        y = factor();
-                        if (bigint_is_zero(y)) {
-                                error("division by zero!");
+        free(table);
+        table = t;
+        table_size = size;
+}
+
+/*
+   Get a node for the given operation, with hash the digit hash for a NUM.
+   The references to left and right, and value, pass to the node, or are
+   dropped if an identical node already exists.
+ */
+static struct node *make_node(enum node_kind kind, struct node *left,
+                              struct node *right, bigint_t *value, size_t hash)
+{
+        bool reduced = modulus != NULL && !in_exponent;
+        struct node *n, **bucket = NULL;
+
+        if (kind != NODE_NUM && kind != NODE_REF) {
+                hash = hash_mix(hash_mix(hash_mix(HASH_INIT, kind),
+                                         left->hash),
+                                right ? right->hash : 0);
+        }
+        hash = hash_mix(hash, reduced);
+
+        if (cse) {
+                if (table_count >= table_size / 2) {
+                        grow_table();
+                }
+
+                bucket = &table[hash & (table_size - 1)];
+                for (n = *bucket; n != NULL; n = n->chain) {
+                        if (n->kind != kind || n->hash != hash ||
+                            n->reduced != reduced) {
+                                continue;
                         }
-                        t = bigint_div(x, y);
-                        free(x);
-                        free(y);
-                        x = t;
-                } else {
-                        break;
+                        if (left == NULL ?
+                            bigint_cmp(n->value, value) == 0 :
+                            n->left == left && n->right == right) {
+                                break;
+                        }
+                }
+
+                if (n != NULL) {
+                        n->uses++;
+                        if (kind != NODE_REF) {
+                                bigint_free(value);
+                        }
+                        if (left != NULL) {
+                                left->uses--;
+                        }
+                        if (right != NULL) {
+                                right->uses--;
+                        }
+                        return n;
                 }
         }
 
-        return x;
+        n = xmalloc(sizeof(*n));
+        n->kind = kind;
+        n->left = left;
+        n->right = right;
+        n->value = value;
+        n->uses = 1;
+        n->hash = hash;
+        n->task = NULL;
+        n->reduced = reduced;
+        n->next = nodes;
+        nodes = n;
+        estimate(n);
+
+        if (cse) {
+                n->chain = *bucket;
+                *bucket = n;
+                table_count++;
+        }
+
+        return n;
 }
 
-static bigint_t *factor(void)
+/* Free the nodes of the current line. */
+static void free_nodes(void)
 {
-        bigint_t *x, *res;
+        struct node *n;
 
-        if (current_token.kind == SUB) {
-                next_token();
-                x = factor();
-                res = bigint_neg(x);
-                free(x);
-        } else if (current_token.kind == LP) {
-                next_token();
-                res = sum();
-                if (current_token.kind != RP) {
-                        error("expected ')'");
+        while (nodes != NULL) {
+                n = nodes;
+                nodes = n->next;
+                if (n->kind != NODE_REF) {
+                        bigint_free(n->value);
                 }
-                next_token();
-        } else if (current_token.kind == NUM) {
-                res = current_token.value;
-                next_token();
+                free(n);
+        }
+
+        if (table_count > 0) {
+                memset(table, 0, sizeof(table[0]) * table_size);
+                table_count = 0;
+        }
+}
+
+/* Drop a reference to n, freeing its value after the last. */
+static void release(struct node *n)
+{
+        assert(n->uses > 0);
+
+        if (--n->uses == 0) {
+                if (n->kind != NODE_REF) {
+                        bigint_free(n->value);
+                }
+                n->value = NULL;
+        }
+}
+
+/* Take n's value as the destination for a result computed from it, if this
+   is the last reference to it. */
+static bigint_t *reuse(struct node *n)
+{
+        bigint_t *x = NULL;
+
+        if (n->uses == 1 && n->kind != NODE_REF) {
+                x = n->value;
+                n->value = NULL;
+        }
+
+        return x;
+}
+
+static bigint_t *eval(struct node *n);
+
+/*
+   A subtree evaluated as a pool task. An error in it is kept for the thread
+   joining the task, which passes it on once no other tasks it started are
+   still running, so that error() never unwinds past them.
+ */
+struct eval_task {
+        struct pool_task task;
+        struct node *n;
+        bool forked, failed;
+        char message[sizeof(error_message)];
+};
+
+static void eval_run(void *arg)
+{
+        struct eval_task *t = arg;
+        jmp_buf jump, *prev = error_jump;
+
+        t->failed = false;
+        error_jump = &jump;
+        if (setjmp(jump) == 0) {
+                eval(t->n);
         } else {
-                error("expected '-', number or '('");
+                t->failed = true;
+                memcpy(t->message, error_message, sizeof(t->message));
         }
+        error_jump = prev;
+}
 
-        return res;
+/* Pass on the error of a finished task, if any. */
+static void eval_check(const struct eval_task *t)
+{
+        char message[sizeof(t->message)];
+
+        if (t->failed) {
+                memcpy(message, t->message, sizeof(message));
+                error("%s", message);
+        }
 }
 
-int main()
+/* Evaluate the count nodes in n, which are independent, on several threads
+   if more than one of them is large. */
+static void eval_all(size_t count, struct node **n)
 {
-        bigint_t *x;
+        struct eval_task *tasks, failed;
+        size_t i, large = 0;
 
-        for (;;) {
-                next_token();
-                x = expr();
-                if (x == NULL) {
-                        break;
+        for (i = 0; i < count; i++) {
+                large += worth_task(n[i]);
+        }
+        if (large < 2) {
+                for (i = 0; i < count; i++) {
+                        eval(n[i]);
+                }
+                return;
+        }
+
+        /* Fork all the large ones but the last, and do the rest here. */
+        tasks = xmalloc(sizeof(tasks[0]) * count);
+        for (i = 0; i < count; i++) {
+                tasks[i].n = n[i];
+                tasks[i].forked = worth_task(n[i]) && --large > 0;
+                if (tasks[i].forked) {
+                        pool_fork(&tasks[i].task, eval_run, &tasks[i]);
+                }
+        }
+        for (i = 0; i < count; i++) {
+                if (!tasks[i].forked) {
+                        eval_run(&tasks[i]);
+                }
+        }
+        for (i = count; i-- > 0;) {
+                if (tasks[i].forked) {
+                        pool_join(&tasks[i].task);
+                }
+        }
+
+        for (i = 0; i < count && !tasks[i].failed; i++) {
+        }
+        if (i < count) {
+                failed = tasks[i];
+                free(tasks);
+                eval_check(&failed);
+        }
+        free(tasks);
+}
+
+/* Do eval_all(), but return false with the message of an error in it left
+   in error_message rather than passing the error on, so that the caller
+   can clean up first. */
+static bool try_eval_all(size_t count, struct node **n)
+{
+        jmp_buf jump, *prev = error_jump;
+
+        error_jump = &jump;
+        if (setjmp(jump) != 0) {
+                error_jump = prev;
+                return false;
+        }
+        eval_all(count, n);
+        error_jump = prev;
+
+        return true;
+}
+
+/* Check whether n and m chain together as a sum or as a product. */
+static bool same_chain(const struct node *n, const struct node *m)
+{
+        if (n->kind == NODE_MUL) {
+                return m->kind == NODE_MUL;
+        }
+
+        return (n->kind == NODE_ADD || n->kind == NODE_SUB) &&
+               (m->kind == NODE_ADD || m->kind == NODE_SUB);
+}
+
+/* Check whether child, an operand of the chain node n, is part of the same
+   chain: not yet evaluated and used nowhere else. */
+static bool in_chain(const struct node *n, const struct node *child)
+{
+        return same_chain(n, child) && child->value == NULL &&
+               child->uses == 1;
+}
+
+/* An operand of a chain: a term of a sum, subtracted if negative is set, or
+   a factor of a product. */
+struct operand {
+        bigint_t *value;
+        size_t size;
+        bool negative;
+        bool owned;             /* Whether value can be consumed. */
+};
+
+/* Min-heap of operands by size. */
+static void heap_push(struct operand *heap, size_t *len, struct operand x)
+{
+        size_t i = (*len)++, parent;
+
+        while (i > 0) {
+                parent = (i - 1) / 2;
+                if (heap[parent].size <= x.size) {
+                        break;
+                }
+                heap[i] = heap[parent];
+                i = parent;
+        }
+        heap[i] = x;
+}
+
+static struct operand heap_pop(struct operand *heap, size_t *len)
+{
+        struct operand top = heap[0], x = heap[--*len];
+        size_t i = 0, child;
+
+        while ((child = 2 * i + 1) < *len) {
+                if (child + 1 < *len && heap[child + 1].size < heap[child].size) {
+                        child++;
+                }
+                if (x.size <= heap[child].size) {
+                        break;
+                }
+                heap[i] = heap[child];
+                i = child;
+        }
+        heap[i] = x;
+
+        return top;
+}
+
+/* Combine the operands x and y of the chain n. */
+static struct operand combine(const struct node *n, struct operand x,
+                              struct operand y)
+{
+        bigint_t *v, *dst;
+
+        dst = x.owned ? x.value : y.owned ? y.value : NULL;
+        if (n->reduced) {
+                v = n->kind == NODE_MUL ?
+                    bigint_modmul_into(dst, modulus, x.value, y.value) :
+                    x.negative == y.negative ?
+                    bigint_modadd_into(dst, modulus, x.value, y.value) :
+                    bigint_modsub_into(dst, modulus, x.value, y.value);
+        } else if (n->kind == NODE_MUL) {
+                v = bigint_mul_into(dst, x.value, y.value);
+        } else if (x.negative == y.negative) {
+                /* +-(x + y) */
+                v = bigint_add_into(dst, x.value, y.value);
+        } else {
+                /* +-(x - y) */
+                v = bigint_sub_into(dst, x.value, y.value);
+        }
+        if (x.owned && y.owned) {
+                bigint_free(y.value);
+        }
+
+        x.value = v;
+        x.owned = true;
+        x.size = bigint_max_stringlen(v);
+
+        return x;
+}
+
+/* Estimated cost of combine(n, x, y), as for estimate(). */
+static double combine_cost(const struct node *n, struct operand x,
+                           struct operand y)
+{
+        double a = x.size / 9 + 1, b = y.size / 9 + 1;
+
+        return n->kind == NODE_MUL ? a * b : a > b ? a : b;
+}
+
+struct combine_task {
+        struct pool_task task;
+        const struct node *n;
+        struct operand x, y;
+};
+
+static void combine_run(void *arg)
+{
+        struct combine_task *t = arg;
+
+        t->x = combine(t->n, t->x, t->y);
+}
+
+/*
+   Compute the sum or product rooted at n by gathering all of its operands
+   and then repeatedly combining the two smallest. Folding left to right
+   would multiply an ever longer accumulator by short factors, which is the
+   worst case for the fast multiplication algorithms; this way, operands are
+   of similar length when combined. Once they are large, several pairs are
+   combined at a time, one per thread.
+ */
+static void reduce_chain(struct node *n)
+{
+        struct node **stack, **used, *m, *child[2];
+        bool *signs, negative[2];
+        struct operand *heap, x, y;
+        struct combine_task *pairs;
+        size_t depth = 0, count = 0, len = 0, cap = 16, i, k;
+        size_t threads = pool_threads();
+        char message[sizeof(error_message)];
+        bigint_t *v;
+
+        stack = xmalloc(sizeof(stack[0]) * cap);
+        signs = xmalloc(sizeof(signs[0]) * cap);
+        used = xmalloc(sizeof(used[0]) * cap);
+        heap = xmalloc(sizeof(heap[0]) * cap);
+        pairs = xmalloc(sizeof(pairs[0]) * threads);
+
+        /* Walk the chain with an explicit stack, as it can be very deep. */
+        stack[depth] = n;
+        signs[depth++] = false;
+        while (depth > 0) {
+                m = stack[--depth];
+                child[0] = m->left;
+                child[1] = m->right;
+                negative[0] = signs[depth];
+                negative[1] = signs[depth] ^ (m->kind == NODE_SUB);
+
+                for (i = 0; i < 2; i++) {
+                        if (depth == cap || count == cap) {
+                                cap *= 2;
+                                stack = xrealloc(stack, sizeof(stack[0]) * cap);
+                                signs = xrealloc(signs, sizeof(signs[0]) * cap);
+                                used = xrealloc(used, sizeof(used[0]) * cap);
+                                heap = xrealloc(heap, sizeof(heap[0]) * cap);
+                        }
+
+                        if (in_chain(n, child[i])) {
+                                stack[depth] = child[i];
+                                signs[depth++] = negative[i];
+                                continue;
+                        }
+
+                        /* Keep the sign in the heap slot until the
+                           operands are evaluated. */
+                        heap[count].negative = negative[i];
+                        used[count++] = child[i];
+                }
+        }
+
+        if (!try_eval_all(count, used)) {
+                memcpy(message, error_message, sizeof(message));
+                free(stack);
+                free(signs);
+                free(used);
+                free(heap);
+                free(pairs);
+                error("%s", message);
+        }
+        for (i = 0; i < count; i++) {
+                x.negative = heap[i].negative;
+                v = used[i]->value;
+                x.value = reuse(used[i]);
+                x.owned = (x.value != NULL);
+                if (!x.owned) {
+                        x.value = v;
+                }
+                x.size = bigint_max_stringlen(v);
+                heap_push(heap, &len, x);
+        }
+
+        while (len > 1) {
+                k = 0;
+                do {
+                        x = heap_pop(heap, &len);
+                        y = heap_pop(heap, &len);
+                        pairs[k++] = (struct combine_task){.n = n, .x = x,
+                                                           .y = y};
+                } while (len > 1 && k < threads &&
+                         combine_cost(n, x, y) >= PARALLEL_COST);
+
+                for (i = 1; i < k; i++) {
+                        pool_fork(&pairs[i].task, combine_run, &pairs[i]);
+                }
+                combine_run(&pairs[0]);
+                for (i = k; i-- > 1;) {
+                        pool_join(&pairs[i].task);
+                }
+
+                for (i = 0; i < k; i++) {
+                        heap_push(heap, &len, pairs[i].x);
+                }
+        }
+
+        x = heap_pop(heap, &len);
+        assert(x.owned);
+        n->value = !x.negative ? x.value :
+                   n->reduced ? bigint_modneg_into(x.value, modulus, x.value) :
+                   bigint_neg_into(x.value, x.value);
+
+        for (i = 0; i < count; i++) {
+                release(used[i]);
+        }
+
+        free(stack);
+        free(signs);
+        free(used);
+        free(heap);
+        free(pairs);
+}
+
+/* Compute n = x ** y. Bases 0, 1 and -1 take exponents of any size, as only
+   the parity of y matters to them, and so do residues. */
+static void power(struct node *n, const bigint_t *x, const bigint_t *y)
+{
+        static const uint32_t two = 2;
+        size_t size = bigint_raw_size(x);
+        unsigned char low = 0;
+        bool negative, unit;
+        bigint_t *t;
+        uint64_t e;
+
+        t = bigint_create(0, NULL, false);
+        negative = bigint_cmp(y, t) < 0;
+        bigint_free(t);
+        if (negative) {
+                error("negative exponent!");
+        }
+
+        if (n->reduced) {
+                n->value = bigint_modpow_into(reuse(n->left), modulus, x, y);
+                release(n->left);
+                release(n->right);
+                return;
+        }
+
+        if (size == 1) {
+                bigint_export_raw(x, &low);
+        }
+        unit = (size == 0 || (size == 1 && low == 1));
+
+        if (!exponent(y, &e)) {
+                if (!unit) {
+                        error("power too large!");
+                }
+                t = bigint_create(1, &two, false);
+                t = bigint_rem_into(t, y, t);
+                e = bigint_is_zero(t) ? 2 : 3;
+                bigint_free(t);
+        }
+        if (!unit && (double)size * e > INT_MAX) {
+                error("power too large!");
+        }
+
+        n->value = bigint_pow_into(reuse(n->left), x, e);
+        release(n->left);
+        release(n->right);
+}
+
+/* Compute the value of n, whose left operand has been evaluated unless n
+   heads a chain. */
+static void compute(struct node *n)
+{
+        struct eval_task task;
+        bigint_t *x, *y;
+
+        if (n->kind == NODE_ADD || n->kind == NODE_SUB ||
+            n->kind == NODE_MUL) {
+                reduce_chain(n);
+                return;
+        }
+
+        x = n->left->value;
+
+        if (n->kind == NODE_NEG) {
+                n->value = n->reduced ?
+                           bigint_modneg_into(reuse(n->left), modulus, x) :
+                           bigint_neg_into(reuse(n->left), x);
+                release(n->left);
+                return;
+        }
+
+        if (n->kind == NODE_POW) {
+                power(n, x, eval(n->right));
+                return;
+        }
+
+        assert(n->kind == NODE_DIV);
+
+        if (n->task != NULL) {
+                pool_join(&n->task->task);
+                task = *n->task;
+                free(n->task);
+                n->task = NULL;
+                eval_check(&task);
+        }
+
+        y = eval(n->right);
+        if (bigint_is_zero(y)) {
+                error("division by zero!");
+        }
+
+        n->value = bigint_div_into(reuse(n->left), x, y);
+        release(n->left);
+        release(n->right);
+}
+
+/* Compute the nodes from m up to n along the path set up by eval(). */
+static void climb(struct node *n, struct node *m)
+{
+        for (;;) {
+                if (m->value == NULL &&
+                    (m == n || !in_chain(m->up, m))) {
+                        compute(m);
+                }
+                if (m == n) {
+                        break;
+                }
+                m = m->up;
+        }
+}
+
+/* Do climb(n, m) when there are forked divisors along the path, joining
+   those left over if it fails. */
+static void climb_joining(struct node *n, struct node *m)
+{
+        char message[sizeof(error_message)];
+        jmp_buf jump, *prev = error_jump;
+        struct node *k;
+
+        error_jump = &jump;
+        if (setjmp(jump) == 0) {
+                climb(n, m);
+                error_jump = prev;
+                return;
+        }
+        error_jump = prev;
+
+        memcpy(message, error_message, sizeof(message));
+        for (k = n; k != NULL; k = k->left) {
+                if (k->task != NULL) {
+                        pool_join(&k->task->task);
+                        free(k->task);
+                        k->task = NULL;
+                }
+        }
+        error("%s", message);
+}
+
+/*
+   Evaluate n, returning its value, which stays with n. Expressions nest to
+   the left, so the left operands are evaluated by walking down to the first
+   one with a value and then back up, rather than by recursion. Nodes inside
+   a sum or product are skipped on the way up and left for the head of the
+   chain to gather.
+
+   On the way down, the divisors of large divisions are forked as tasks to be
+   evaluated along with their dividends.
+ */
+static bigint_t *eval(struct node *n)
+{
+        struct node *m = n;
+        bool forked = false;
+
+        while (m->value == NULL && m->left->value == NULL) {
+                if (m->kind == NODE_DIV && worth_task(m->left) &&
+                    worth_task(m->right)) {
+                        m->task = xmalloc(sizeof(*m->task));
+                        m->task->n = m->right;
+                        pool_fork(&m->task->task, eval_run, m->task);
+                        forked = true;
+                }
+                m->left->up = m;
+                m = m->left;
+        }
+
+        if (forked) {
+                climb_joining(n, m);
+        } else {
+                climb(n, m);
+        }
+
+        return n->value;
+}
+
+/* Evaluate the line x, bringing a residue back to its value in 0 to N - 1. */
+static bigint_t *eval_line(struct node *x)
+{
+        eval(x);
+        if (x->reduced) {
+                x->value = bigint_mod_leave_into(x->value, modulus, x->value);
+        }
+
+        return x->value;
+}
+
+/*
+   Grammar:
+
+   <expr>   ::= <sum> EOL | END
+   <sum>    ::= <term> (ADD <term> | SUB <term>)*
+   <term>   ::= <factor> (MUL <factor> | DIV <factor>)*
+   <factor> ::= SUB <factor> | <power>
+   <power>  ::= <atom> (POW <factor>)?
+   <atom>   ::= LP <sum> RP | <number>
+
+   Powers bind tighter than negation, and group to the right, so that -2^2
+   is -4 and 2^3^2 is 2^9.
+
+   The functions below parse a string of tokens according to the grammar and
+   return the corresponding tree. expr() leaves the last token unconsumed to
+   avoid blocking on input.
+*/
+
+static struct node *expr(void);
+static struct node *sum(void);
+static struct node *term(void);
+static struct node *factor(void);
+static struct node *atom(void);
+
+static struct node *expr(void)
+{
+        struct node *res;
+
+        if (current_token.kind == END) {
+                return NULL;
+        }
+
+        res = sum();
+
+        if (current_token.kind != EOL) {
+                error("trailing character(s)");
+        }
+
+        return res;
+}
+
+static struct node *sum(void)
+{
+        struct node *x, *y;
+
+        x = term();
+
+        while (true) {
+                if (current_token.kind == ADD) {
+                        next_token();
+                        y = term();
+                        x = make_node(NODE_ADD, x, y, NULL, 0);
+                } else if (current_token.kind == SUB) {
+                        next_token();
+                        y = term();
+                        x = make_node(NODE_SUB, x, y, NULL, 0);
+                } else {
+                        break;
+                }
+        }
+
+        return x;
+}
+
+static struct node *term(void)
+{
+        struct node *x, *y;
+
+        x = factor();
+
+        while (true) {
+                if (current_token.kind == MUL) {
+                        next_token();
+                        y = factor();
+                        x = make_node(NODE_MUL, x, y, NULL, 0);
+                } else if (current_token.kind == DIV) {
+                        if (modulus != NULL && !in_exponent) {
+                                error("no division under --mod!");
+                        }
+                        next_token();
+                        y = factor();
+                        x = make_node(NODE_DIV, x, y, NULL, 0);
+                } else {
+                        break;
+                }
+        }
+
+        return x;
+}
+
+static struct node *factor(void)
+{
+        struct node *x, *y;
+        bool outer;
+
+        if (current_token.kind == SUB) {
+                next_token();
+                x = factor();
+                return make_node(NODE_NEG, x, NULL, NULL, 0);
+        }
+
+        x = atom();
+        if (current_token.kind == POW) {
+                next_token();
+                outer = in_exponent;
+                in_exponent = true;
+                y = factor();
+                in_exponent = outer;
+                x = make_node(NODE_POW, x, y, NULL, 0);
+        }
+
+        return x;
+}
+
+static struct node *atom(void)
+{
+        enum node_kind kind;
+        struct node *res;
+        bigint_t *value;
+
+        if (current_token.kind == LP) {
+                next_token();
+                res = sum();
+                if (current_token.kind != RP) {
+                        error("expected ')'");
+                }
+                next_token();
+        } else if (current_token.kind == NUM) {
+                value = current_token.value;
+                kind = current_token.borrowed ? NODE_REF : NODE_NUM;
+                if (modulus != NULL && !in_exponent) {
+                        /* The residue of a borrowed value is a number of
+                           its own. */
+                        value = kind == NODE_REF ?
+                                bigint_mod_enter(modulus, value) :
+                                bigint_mod_enter_into(value, modulus, value);
+                        kind = NODE_NUM;
+                }
+                res = make_node(kind, NULL, NULL, value, current_token.hash);
+                current_token.value = NULL;
+                next_token();
+        } else {
+                error("expected '-', number or '('");
+        }
+
+        return res;
+}
+
+/*
+   Batch mode: the main thread cuts the input into jobs of whole lines, which
+   worker threads evaluate into text of their own. The jobs are written out in
+   input order, so the output is the same as without -j.
+ */
+struct job {
+        const char *data;
+        size_t len;
+        char *copy;             /* Buffer holding data, unless mapped. */
+        char *out;
+        size_t out_len, out_size;
+        bool failed, done;
+        char message[sizeof(error_message)];
+        struct job *next;       /* Next job in input order. */
+};
+
+static struct {
+        pthread_mutex_t lock;
+        pthread_cond_t work, done;
+        struct job *head, *tail;        /* Jobs not yet written out. */
+        struct job *next_work;          /* First job not yet taken. */
+        bool finished;
+} batch = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .work = PTHREAD_COND_INITIALIZER,
+        .done = PTHREAD_COND_INITIALIZER,
+};
+
+/*
+   Cut the next job from the input: the whole lines within the next
+   BLOCK_SIZE bytes, or a single longer line. Returns NULL at the end of the
+   input.
+ */
+static struct job *next_job(void)
+{
+        size_t avail, scanned, cut;
+        struct job *job;
+        const char *nl;
+
+        while (input.len - input.pos < BLOCK_SIZE && refill()) {
+        }
+
+        avail = input.len - input.pos;
+        if (avail == 0) {
+                return NULL;
+        }
+
+        scanned = avail < BLOCK_SIZE ? avail : BLOCK_SIZE;
+        for (cut = scanned; cut > 0; cut--) {
+                if (input.data[input.pos + cut - 1] == '\n') {
+                        break;
+                }
+        }
+        while (cut == 0) {
+                nl = memchr(input.data + input.pos + scanned, '\n',
+                            avail - scanned);
+                if (nl != NULL) {
+                        cut = nl - (input.data + input.pos) + 1;
+                        break;
+                }
+                scanned = avail;
+                if (!refill()) {
+                        /* The last line has no end. */
+                        cut = avail;
+                        break;
+                }
+                avail = input.len - input.pos;
+        }
+
+        job = xmalloc(sizeof(*job));
+        memset(job, 0, sizeof(*job));
+        if (input.mapped) {
+                job->data = input.data + input.pos;
+        } else {
+                job->copy = xmalloc(cut);
+                memcpy(job->copy, input.data + input.pos, cut);
+                job->data = job->copy;
+        }
+        job->len = cut;
+        input.pos += cut;
+
+        return job;
+}
+
+/* Append the result x to the output of job, as main() would print it. */
+static void emit(struct job *job, const bigint_t *x)
+{
+        size_t n = (hex_output ? bigint_max_hexlen(x) :
+                    bigint_max_stringlen(x)) + 3;
+
+        if (job->out_size - job->out_len < n) {
+                job->out_size = 2 * (job->out_len + n);
+                job->out = xrealloc(job->out, job->out_size);
+        }
+
+        if (hex_output) {
+                bigint_tohex(x, job->out + job->out_len);
+        } else {
+                bigint_tostring(x, job->out + job->out_len);
+        }
+        job->out_len += strlen(job->out + job->out_len);
+        job->out[job->out_len++] = '\n';
+        job->out[job->out_len++] = '\n';
+}
+
+static void run_job(struct job *job)
+{
+        jmp_buf jump;
+        struct node *x;
+
+        text.pos = job->data;
+        text.end = job->data + job->len;
+        current_token.kind = EOL;
+
+        error_jump = &jump;
+        if (setjmp(jump) != 0) {
+                job->failed = true;
+                memcpy(job->message, error_message, sizeof(job->message));
+                free_nodes();
+                in_exponent = false;
+                error_jump = NULL;
+                return;
+        }
+
+        for (;;) {
+                next_token();
+                x = expr();
+                if (x == NULL) {
+                        break;
+                }
+                emit(job, eval_line(x));
+                release(x);
+                free_nodes();
+        }
+
+        error_jump = NULL;
+}
+
+static void *worker(void *arg)
+{
+        bigint_ctx_t *ctx = bigint_ctx_create();
+        struct job *job;
+
+        (void)arg;
+        bigint_ctx_use(ctx);
+
+        for (;;) {
+                pthread_mutex_lock(&batch.lock);
+                while (batch.next_work == NULL && !batch.finished) {
+                        pthread_cond_wait(&batch.work, &batch.lock);
+                }
+                job = batch.next_work;
+                if (job != NULL) {
+                        batch.next_work = job->next;
+                }
+                pthread_mutex_unlock(&batch.lock);
+
+                if (job == NULL) {
+                        free(table);
+                        bigint_ctx_destroy(ctx);
+                        return NULL;
+                }
+
+                run_job(job);
+
+                pthread_mutex_lock(&batch.lock);
+                job->done = true;
+                pthread_cond_broadcast(&batch.done);
+                pthread_mutex_unlock(&batch.lock);
+        }
+}
+
+/* Evaluate the input with the given number of worker threads. */
+static void run_batch(int threads)
+{
+        pthread_t *workers = xmalloc(sizeof(workers[0]) * threads);
+        int i, in_flight = 0;
+        struct job *job;
+        bool more = true;
+
+        for (i = 0; i < threads; i++) {
+                if (pthread_create(&workers[i], NULL, worker, NULL) != 0) {
+                        error("cannot create thread");
+                }
+        }
+
+        while (more || in_flight > 0) {
+                /* Keep a couple of jobs per worker queued. */
+                if (more && in_flight < 2 * threads) {
+                        job = next_job();
+                        if (job == NULL) {
+                                more = false;
+                                continue;
+                        }
+
+                        pthread_mutex_lock(&batch.lock);
+                        if (batch.tail != NULL) {
+                                batch.tail->next = job;
+                        } else {
+                                batch.head = job;
+                        }
+                        batch.tail = job;
+                        if (batch.next_work == NULL) {
+                                batch.next_work = job;
+                        }
+                        pthread_cond_signal(&batch.work);
+                        pthread_mutex_unlock(&batch.lock);
+                        in_flight++;
+                        continue;
+                }
+
+                /* Write out the oldest job. */
+                pthread_mutex_lock(&batch.lock);
+                while (!batch.head->done) {
+                        pthread_cond_wait(&batch.done, &batch.lock);
+                }
+                job = batch.head;
+                batch.head = job->next;
+                if (batch.head == NULL) {
+                        batch.tail = NULL;
+                }
+                pthread_mutex_unlock(&batch.lock);
+                in_flight--;
+
+                fwrite(job->out, 1, job->out_len, stdout);
+                if (job->failed) {
+                        fflush(stdout);
+                        error("%s", job->message);
+                }
+
+                free(job->out);
+                free(job->copy);
+                free(job);
+        }
+
+        pthread_mutex_lock(&batch.lock);
+        batch.finished = true;
+        pthread_cond_broadcast(&batch.work);
+        pthread_mutex_unlock(&batch.lock);
+
+        for (i = 0; i < threads; i++) {
+                pthread_join(workers[i], NULL);
+        }
+        free(workers);
+}
+
+/*
+   Session mode. Each line is looked up in an LRU cache of results by its
+   normal form, before it is parsed, so that a repeated query costs neither
+   parsing nor evaluation. Lines that fail are not cached. A name is looked
+   up as the $k it is bound to at the time, and $k never changes, so a key
+   stands for the same value for the rest of the session.
+ */
+#ifndef CACHE_ENTRIES
+#define CACHE_ENTRIES 1024
+#endif
+
+struct cache_entry {
+        char *key;
+        size_t len, hash;
+        struct result *result;
+        struct cache_entry *chain;              /* Next in the same bucket. */
+        struct cache_entry *newer, *older;
+};
+
+static struct {
+        struct cache_entry **table;
+        size_t size, count;
+        long limit;
+        struct cache_entry *newest, *oldest;
+} cache = {.limit = CACHE_ENTRIES};
+
+/* A key being put together. */
+static struct {
+        char *data;
+        size_t len, size;
+} key;
+
+static void key_append(const char *s, size_t n)
+{
+        if (key.size - key.len < n) {
+                key.size = 2 * (key.len + n);
+                key.data = xrealloc(key.data, key.size);
+        }
+        memcpy(key.data + key.len, s, n);
+        key.len += n;
+}
+
+/*
+   Put the line s..end in normal form in key: without blanks, with the
+   leading zeros of numbers dropped, hex digits in lower case, and names
+   replaced by the $k they are bound to. Numbers, names and @files are kept
+   apart by a blank where they would run together, as they do in the line.
+   Returns false if the line refers to a result that does not exist.
+ */
+static bool normalize(const char *s, const char *end)
+{
+        char buf[32], digit;
+        struct binding *b;
+        const char *t;
+        unsigned long k;
+        bool word = false, hex;
+        int c;
+
+        key.len = 0;
+        while (s < end) {
+                c = (unsigned char)*s;
+                if (c == ' ' || c == '\t') {
+                        s++;
+                        continue;
+                }
+                if (!isdigit(c) && c != '$' && c != '@' && !name_start(c)) {
+                        key_append(s++, 1);
+                        word = false;
+                        continue;
+                }
+                if (word) {
+                        key_append(" ", 1);
+                }
+                word = true;
+
+                if (c == '@') {
+                        /* The path runs as the tokenizer has it, and a blank
+                           ends it, so that a '-' or '/' after it is not
+                           taken into it. */
+                        for (t = s + 1; t < end && strchr(" \t\n+*^()", *t) ==
+                             NULL; t++) {
+                        }
+                        key_append(s, t - s);
+                        key_append(" ", 1);
+                        word = false;
+                        s = t;
+                        continue;
+                }
+
+                if (isdigit(c)) {
+                        hex = (c == '0' && end - s > 2 &&
+                               (s[1] == 'x' || s[1] == 'X') &&
+                               isxdigit((unsigned char)s[2]));
+                        if (hex) {
+                                key_append("0x", 2);
+                                s += 2;
+                        }
+                        while (s + 1 < end && *s == '0' &&
+                               (hex ? isxdigit((unsigned char)s[1]) :
+                                isdigit((unsigned char)s[1]))) {
+                                s++;
+                        }
+                        for (; s < end && (hex ? isxdigit((unsigned char)*s) :
+                                           isdigit((unsigned char)*s)); s++) {
+                                digit = (char)tolower((unsigned char)*s);
+                                key_append(&digit, 1);
+                        }
+                        continue;
+                }
+
+                /* $k, or a name for it. */
+                if (c == '$') {
+                        k = 0;
+                        for (t = s + 1; t < end && isdigit((unsigned char)*t);
+                             t++) {
+                                k = k < ULONG_MAX / 10 ?
+                                    10 * k + (*t - '0') : ULONG_MAX;
+                        }
+                        if (find_result(k) == NULL) {
+                                return false;
+                        }
+                } else {
+                        for (t = s + 1; t < end && name_char(*t); t++) {
+                        }
+                        b = find_binding(s, t - s);
+                        if (b == NULL) {
+                                return false;
+                        }
+                        k = b->result->number;
+                }
+                snprintf(buf, sizeof(buf), "$%lu", k);
+                key_append(buf, strlen(buf));
+                s = t;
+        }
+
+        return true;
+}
+
+static size_t key_hash(void)
+{
+        size_t h = HASH_INIT, i;
+
+        for (i = 0; i < key.len; i++) {
+                h = hash_mix(h, (unsigned char)key.data[i]);
+        }
+
+        return h;
+}
+
+static void cache_unlink(struct cache_entry *e)
+{
+        *(e->newer ? &e->newer->older : &cache.newest) = e->older;
+        *(e->older ? &e->older->newer : &cache.oldest) = e->newer;
+}
+
+static void cache_push(struct cache_entry *e)
+{
+        e->newer = NULL;
+        e->older = cache.newest;
+        *(cache.newest ? &cache.newest->newer : &cache.oldest) = e;
+        cache.newest = e;
+}
+
+/* Get the cached result for key, making it the most recently used. */
+static struct result *cache_find(size_t hash)
+{
+        struct cache_entry *e;
+
+        if (cache.table == NULL) {
+                return NULL;
+        }
+
+        for (e = cache.table[hash & (cache.size - 1)]; e != NULL;
+             e = e->chain) {
+                if (e->hash == hash && e->len == key.len &&
+                    memcmp(e->key, key.data, key.len) == 0) {
+                        cache_unlink(e);
+                        cache_push(e);
+                        return e->result;
+                }
+        }
+
+        return NULL;
+}
+
+/* Cache r for key, dropping the least recently used entry if full. */
+static void cache_add(size_t hash, struct result *r)
+{
+        struct cache_entry *e, **p;
+
+        if (cache.table == NULL) {
+                for (cache.size = 1; cache.size < 2 * (size_t)cache.limit;
+                     cache.size *= 2) {
+                }
+                cache.table = xmalloc(sizeof(cache.table[0]) * cache.size);
+                memset(cache.table, 0, sizeof(cache.table[0]) * cache.size);
+        }
+
+        if (cache.count == (size_t)cache.limit) {
+                e = cache.oldest;
+                for (p = &cache.table[e->hash & (cache.size - 1)]; *p != e;
+                     p = &(*p)->chain) {
+                }
+                *p = e->chain;
+                cache_unlink(e);
+                drop_result(e->result);
+                free(e->key);
+                free(e);
+                cache.count--;
+        }
+
+        e = xmalloc(sizeof(*e));
+        e->key = xmalloc(key.len);
+        memcpy(e->key, key.data, key.len);
+        e->len = key.len;
+        e->hash = hash;
+        e->result = r;
+        r->refs++;
+        p = &cache.table[hash & (cache.size - 1)];
+        e->chain = *p;
+        *p = e;
+        cache_push(e);
+        cache.count++;
+}
+
+/* Keep r as the next $k, which is r's own number unless it came from the
+   cache. */
+static void keep_result(struct result *r)
+{
+        results++;
+        drop_result(history[results % HISTORY]);
+        history[results % HISTORY] = r;
+        r->refs++;
+}
+
+/* Bind the len-character name to r. */
+static void bind_name(const char *name, size_t len, struct result *r)
+{
+        struct binding *b = find_binding(name, len);
+
+        if (b == NULL) {
+                b = xmalloc(sizeof(*b));
+                b->name = xmalloc(len + 1);
+                memcpy(b->name, name, len);
+                b->name[len] = '\0';
+                b->result = NULL;
+                b->next = bindings;
+                bindings = b;
+        }
+
+        r->refs++;
+        drop_result(b->result);
+        b->result = r;
+}
+
+/* Skip blanks in s..end. */
+static const char *skip_blanks(const char *s, const char *end)
+{
+        while (s < end && (*s == ' ' || *s == '\t')) {
+                s++;
+        }
+
+        return s;
+}
+
+/* If the line s..end starts with "let <name> =", set *name and *len to the
+   name and return the rest of the line; otherwise return s. */
+static const char *let_prefix(const char *s, const char *end,
+                              const char **name, size_t *len)
+{
+        const char *t = skip_blanks(s, end), *n;
+
+        if (end - t < 4 || memcmp(t, "let", 3) != 0 ||
+            (t[3] != ' ' && t[3] != '\t')) {
+                return s;
+        }
+
+        n = skip_blanks(t + 3, end);
+        if (n == end || !name_start(*n)) {
+                return s;
+        }
+        for (t = n + 1; t < end && name_char(*t); t++) {
+        }
+        *name = n;
+        *len = t - n;
+
+        t = skip_blanks(t, end);
+        if (t == end || *t != '=') {
+                error("expected '=' after let %.*s", (int)*len, n);
+        }
+
+        return t + 1;
+}
+
+/* Take the value of the evaluated line x for a result. */
+static struct result *take_result(struct node *x)
+{
+        struct result *r = xmalloc(sizeof(*r));
+        bigint_t *zero;
+
+        if (x->kind == NODE_REF) {
+                /* Not ours to keep, so it is copied. */
+                zero = bigint_create(0, NULL, false);
+                r->value = bigint_add(x->value, zero);
+                bigint_free(zero);
+        } else {
+                r->value = x->value;
+                x->value = NULL;
+        }
+        r->number = results + 1;
+        r->refs = 0;
+
+        return r;
+}
+
+/* Get the result of the line s..end, from the cache or by evaluating it, and
+   keep it. */
+static struct result *session_eval(const char *s, const char *end)
+{
+        const char *name = NULL;
+        struct result *r = NULL;
+        struct node *x;
+        size_t len = 0, hash = 0;
+        bool cached = false;
+
+        s = let_prefix(s, end, &name, &len);
+        if (cache.limit > 0 && normalize(s, end)) {
+                cached = true;
+                hash = key_hash();
+                r = cache_find(hash);
+        }
+
+        if (r == NULL) {
+                text.pos = s;
+                text.end = end;
+                current_token.kind = EOL;
+                next_token();
+                x = expr();
+                if (x == NULL) {
+                        error("expected '-', number or '('");
+                }
+                eval_line(x);
+                r = take_result(x);
+                free_nodes();
+                if (cached) {
+                        cache_add(hash, r);
+                }
+        }
+
+        keep_result(r);
+        if (name != NULL) {
+                bind_name(name, len, r);
+        }
+
+        return r;
+}
+
+/* Answer the line s..end on out. Returns false if out fails. */
+static bool session_answer(FILE *out, const char *s, const char *end)
+{
+        jmp_buf jump, *prev = error_jump;
+        struct result *r;
+
+        error_jump = &jump;
+        if (setjmp(jump) != 0) {
+                /* Drop the literal read ahead, unless a node has it. */
+                if (current_token.kind == NUM && !current_token.borrowed) {
+                        bigint_free(current_token.value);
+                }
+                current_token.value = NULL;
+                free_nodes();
+                in_exponent = false;
+                error_jump = prev;
+                fprintf(out, "error: %s\n\n", error_message);
+                return fflush(out) == 0;
+        }
+        r = session_eval(s, end);
+        error_jump = prev;
+
+        if ((hex_output ? bigint_fprint_hex(out, r->value) :
+             bigint_fprint(out, r->value)) != 0 ||
+            fputs("\n\n", out) == EOF) {
+                return false;
+        }
+
+        return fflush(out) == 0;
+}
+
+/* Answer the lines of input on out until the input ends or out fails. */
+static void serve(FILE *out)
+{
+        const char *line, *nl;
+        size_t scanned = 0, len;
+
+        for (;;) {
+                len = input.len - input.pos;
+                nl = len > scanned ?
+                     memchr(input.data + input.pos + scanned, '\n',
+                            len - scanned) : NULL;
+                if (nl == NULL) {
+                        scanned = len;
+                        if (refill()) {
+                                continue;
+                        }
+                        if (len == 0) {
+                                return;
+                        }
+                } else {
+                        len = nl + 1 - (input.data + input.pos);
+                }
+
+                /* The line stays put until the next refill(). */
+                line = input.data + input.pos;
+                input.pos += len;
+                scanned = 0;
+                if (!session_answer(out, line, line + len)) {
+                        return;
+                }
+        }
+}
+
+/* The socket file of listen_on(), removed again on the way out. */
+static const char *socket_path;
+
+static void remove_socket(void)
+{
+        unlink(socket_path);
+}
+
+static void remove_socket_and_die(int sig)
+{
+        unlink(socket_path);
+        signal(sig, SIG_DFL);
+        raise(sig);
+}
+
+/* Remove the socket file at addr if it is left over from a server that is
+   gone, which is when nothing answers a connection to it. */
+static void remove_stale_socket(const struct sockaddr_un *addr)
+{
+        struct stat st;
+        int fd;
+
+        if (lstat(addr->sun_path, &st) != 0 || !S_ISSOCK(st.st_mode)) {
+                return;
+        }
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+                return;
+        }
+        if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) != 0 &&
+            errno == ECONNREFUSED) {
+                unlink(addr->sun_path);
+        }
+        close(fd);
+}
+
+/* Serve the clients of a Unix socket at path one at a time, until a signal
+   ends the process. */
+static void listen_on(const char *path)
+{
+        struct sockaddr_un addr;
+        jmp_buf jump;
+        FILE *out;
+        int fd, conn;
+
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+                error("%s: path too long", path);
+        }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path);
+
+        remove_stale_socket(&addr);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+                error("%s: %s", path, strerror(errno));
+        }
+        socket_path = path;
+        atexit(remove_socket);
+        signal(SIGINT, remove_socket_and_die);
+        signal(SIGTERM, remove_socket_and_die);
+        signal(SIGHUP, remove_socket_and_die);
+        if (listen(fd, SOMAXCONN) != 0) {
+                error("%s: %s", path, strerror(errno));
+        }
+
+        /* A client that goes away only ends its connection. */
+        signal(SIGPIPE, SIG_IGN);
+        input.started = true;
+
+        for (;;) {
+                conn = accept(fd, NULL, NULL);
+                if (conn < 0) {
+                        if (errno == EINTR || errno == ECONNABORTED) {
+                                continue;
+                        }
+                        error("accept failed: %s", strerror(errno));
+                }
+
+                out = fdopen(conn, "w");
+                if (out == NULL) {
+                        close(conn);
+                        continue;
+                }
+
+                input.fd = conn;
+                input.pos = input.len = 0;
+                input.eof = false;
+
+                /* A read error ends the connection too. */
+                error_jump = &jump;
+                if (setjmp(jump) == 0) {
+                        serve(out);
+                }
+                error_jump = NULL;
+
+                fclose(out);
+        }
+}
+
+static void print_stats(void)
+{
+        bigint_print_stats(stderr);
+}
+
+/* Set up --mod with str, a positive decimal or 0x literal. Returns false
+   if it is not one. */
+static bool set_modulus(const char *str)
+{
+        size_t len = strlen(str), i;
+        bool hex = (len > 2 && str[0] == '0' &&
+                    (str[1] == 'x' || str[1] == 'X'));
+        bigint_t *x;
+
+        if (len == 0 || len > INT_MAX) {
+                return false;
+        }
+        for (i = hex ? 2 : 0; i < len; i++) {
+                if (hex ? !isxdigit(str[i]) : !isdigit(str[i])) {
+                        return false;
+                }
+        }
+
+        x = hex ? bigint_create_hex(len, str) : bigint_create_str(len, str);
+        if (bigint_is_zero(x)) {
+                bigint_free(x);
+                return false;
+        }
+
+        modulus = bigint_mod_create(x);
+        modulus_limbs = bigint_max_stringlen(x) / 9 + 1;
+        bigint_free(x);
+
+        return true;
+}
+
+static void usage(const char *argv0)
+{
+        fprintf(stderr, "usage: %s [--cse] [--hex] [--mod N] [--save FILE] "
+                "[--stats] [-j N] [-t N]\n"
+                "       %s [--repl | --listen PATH] [--cache N] [--cse] "
+                "[--hex] [--mod N]\n"
+                "              [--stats] [-t N]\n"
+                "  --cse        evaluate repeated subexpressions only once\n"
+                "  --hex        print results in hex, as 0x literals\n"
+                "  --repl       answer each line as it is read, keeping the\n"
+                "               results as $1, $2, ...; 'let NAME = EXPR'\n"
+                "               also binds the result to NAME\n"
+                "  --listen PATH  the same, for clients of a Unix socket at\n"
+                "               PATH, served one at a time\n"
+                "  --cache N    answer repeated lines of a session from a\n"
+                "               cache of the last N (default %d)\n"
+                "  --mod N      compute modulo N > 0, printing results from 0\n"
+                "               to N - 1; exponents are computed in full, and\n"
+                "               division is not allowed outside them\n"
+                "  --save FILE  also store the last result in FILE, to be\n"
+                "               used as an @FILE operand\n"
+                "  --stats      time the bigint operations, and report them\n"
+                "               on stderr at exit\n"
+                "  -j N         evaluate lines in batches on N threads\n"
+                "  -t N         spread large operations over N threads\n",
+                argv0, argv0, CACHE_ENTRIES);
+        exit(1);
+}
+
+int main(int argc, char **argv)
+{
+        const char *save = NULL, *listen_path = NULL;
+        struct node *x;
+        bigint_t *v;
+        int i, threads = 1, op_threads = 1;
+        char *end;
+
+        for (i = 1; i < argc; i++) {
+                if (strcmp(argv[i], "--cse") == 0) {
+                        cse = true;
+                } else if (strcmp(argv[i], "--hex") == 0) {
+                        hex_output = true;
+                } else if (strcmp(argv[i], "--mod") == 0 && i + 1 < argc) {
+                        if (modulus != NULL || !set_modulus(argv[++i])) {
+                                usage(argv[0]);
+                        }
+                } else if (strcmp(argv[i], "--repl") == 0) {
+                        session = true;
+                } else if (strcmp(argv[i], "--listen") == 0 && i + 1 < argc) {
+                        session = true;
+                        listen_path = argv[++i];
+                } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+                        cache.limit = strtol(argv[++i], &end, 10);
+                        if (*end != '\0' || cache.limit < 0) {
+                                usage(argv[0]);
+                        }
+                } else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+                        save = argv[++i];
+                } else if (strcmp(argv[i], "--stats") == 0) {
+                        bigint_set_stats(true);
+                        atexit(print_stats);
+                } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+                        threads = strtol(argv[++i], &end, 10);
+                        if (*end != '\0' || threads < 1) {
+                                usage(argv[0]);
+                        }
+                } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+                        op_threads = strtol(argv[++i], &end, 10);
+                        if (*end != '\0' || op_threads < 1) {
+                                usage(argv[0]);
+                        }
+                } else {
+                        usage(argv[0]);
+                }
+        }
+
+        if ((save != NULL || session) && threads > 1) {
+                usage(argv[0]);
+        }
+        if (session && save != NULL) {
+                usage(argv[0]);
+        }
+
+        bigint_set_threads(op_threads);
+
+        if (listen_path != NULL) {
+                listen_on(listen_path);
+        }
+        if (session) {
+                serve(stdout);
+                return 0;
+        }
+
+        if (threads > 1) {
+                run_batch(threads);
+                return 0;
+        }
+
+        for (;;) {
+                next_token();
+                x = expr();
+                if (x == NULL) {
+                        break;
+                }
+                v = eval_line(x);
+                if (hex_output) {
+                        bigint_fprint_hex(stdout, v);
+                } else {
+                        bigint_fprint(stdout, v);
+                }
+                fputs("\n\n", stdout);
+                if (save != NULL && bigint_save(save, v) != 0) {
+                        error("%s: %s", save, strerror(errno));
                 }
-                bigint_print(x);
-                free(x);
-                printf("\n");
+                release(x);
+                free_nodes();
         }
 
         return 0;
@@ -0,0 +1,246 @@
+#include "pool.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Forked tasks not yet taken, oldest at top. */
+struct deque {
+        struct pool_task **tasks;
+        int top, bottom, size;
+};
+
+/*
+   The deques are few and tasks are coarse, so a single lock guards them all,
+   and a single condition tells sleeping threads that a task was forked or
+   finished.
+ */
+static struct {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        pthread_t *workers;
+        struct deque *deques;   /* One per worker, then the shared one. */
+        int threads;
+        bool stopping;
+        void (*cleanup)(void);
+} pool = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+        .threads = 1,
+};
+
+/* The deque of the calling worker, or NULL outside the pool. */
+static _Thread_local struct deque *self;
+
+static void *xrealloc(void *p, size_t n)
+{
+        p = realloc(p, n);
+        if (p == NULL) {
+                fprintf(stderr, "Out of memory!");
+                exit(1);
+        }
+
+        return p;
+}
+
+static struct deque *own_deque(void)
+{
+        return self != NULL ? self : &pool.deques[pool.threads - 1];
+}
+
+static void push(struct deque *d, struct pool_task *task)
+{
+        if (d->top == d->bottom) {
+                d->top = d->bottom = 0;
+        }
+        if (d->bottom == d->size) {
+                d->size = d->size ? 2 * d->size : 16;
+                d->tasks = xrealloc(d->tasks, sizeof(d->tasks[0]) * d->size);
+        }
+
+        d->tasks[d->bottom++] = task;
+}
+
+/* Remove task from d if it is still there. */
+static bool take_back(struct deque *d, struct pool_task *task)
+{
+        int i;
+
+        for (i = d->bottom - 1; i >= d->top; i--) {
+                if (d->tasks[i] == task) {
+                        for (; i < d->bottom - 1; i++) {
+                                d->tasks[i] = d->tasks[i + 1];
+                        }
+                        d->bottom--;
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+/* Take the newest task of d, else steal the oldest from another deque. */
+static struct pool_task *find_task(struct deque *d)
+{
+        struct deque *victim;
+        int i, start = d - pool.deques;
+
+        if (d->bottom > d->top) {
+                return d->tasks[--d->bottom];
+        }
+
+        for (i = 1; i < pool.threads; i++) {
+                victim = &pool.deques[(start + i) % pool.threads];
+                if (victim->bottom > victim->top) {
+                        return victim->tasks[victim->top++];
+                }
+        }
+
+        return NULL;
+}
+
+/* Run a taken task, with the lock held on entry and exit. */
+static void run(struct pool_task *task)
+{
+        pthread_mutex_unlock(&pool.lock);
+        task->fn(task->arg);
+        pthread_mutex_lock(&pool.lock);
+
+        task->done = true;
+        pthread_cond_broadcast(&pool.cond);
+}
+
+static void *worker(void *arg)
+{
+        struct pool_task *task;
+
+        self = &pool.deques[(intptr_t)arg];
+
+        pthread_mutex_lock(&pool.lock);
+        while (!pool.stopping) {
+                task = find_task(self);
+                if (task != NULL) {
+                        run(task);
+                } else {
+                        pthread_cond_wait(&pool.cond, &pool.lock);
+                }
+        }
+        pthread_mutex_unlock(&pool.lock);
+
+        if (pool.cleanup != NULL) {
+                pool.cleanup();
+        }
+
+        return NULL;
+}
+
+void pool_start(int threads, void (*cleanup)(void))
+{
+        intptr_t i;
+
+        assert(pool.workers == NULL && "Pool already started!");
+
+        if (threads <= 1) {
+                return;
+        }
+
+        pool.deques = xrealloc(NULL, sizeof(pool.deques[0]) * threads);
+        for (i = 0; i < threads; i++) {
+                pool.deques[i] = (struct deque){0};
+        }
+        pool.workers = xrealloc(NULL, sizeof(pool.workers[0]) * (threads - 1));
+        pool.threads = threads;
+        pool.stopping = false;
+        pool.cleanup = cleanup;
+
+        for (i = 0; i < threads - 1; i++) {
+                if (pthread_create(&pool.workers[i], NULL, worker,
+                                   (void *)i) != 0) {
+                        fprintf(stderr, "Cannot create thread!");
+                        exit(1);
+                }
+        }
+}
+
+void pool_stop(void)
+{
+        int i;
+
+        if (pool.workers == NULL) {
+                return;
+        }
+
+        pthread_mutex_lock(&pool.lock);
+        pool.stopping = true;
+        pthread_cond_broadcast(&pool.cond);
+        pthread_mutex_unlock(&pool.lock);
+
+        for (i = 0; i < pool.threads - 1; i++) {
+                pthread_join(pool.workers[i], NULL);
+        }
+
+        for (i = 0; i < pool.threads; i++) {
+                assert(pool.deques[i].top == pool.deques[i].bottom &&
+                       "Tasks still pending!");
+                free(pool.deques[i].tasks);
+        }
+        free(pool.deques);
+        free(pool.workers);
+        pool.deques = NULL;
+        pool.workers = NULL;
+        pool.threads = 1;
+}
+
+int pool_threads(void)
+{
+        return pool.threads;
+}
+
+void pool_fork(struct pool_task *task, void (*fn)(void *arg), void *arg)
+{
+        task->fn = fn;
+        task->arg = arg;
+        task->done = false;
+
+        if (pool.threads == 1) {
+                fn(arg);
+                task->done = true;
+                return;
+        }
+
+        pthread_mutex_lock(&pool.lock);
+        push(own_deque(), task);
+        pthread_cond_broadcast(&pool.cond);
+        pthread_mutex_unlock(&pool.lock);
+}
+
+void pool_join(struct pool_task *task)
+{
+        struct pool_task *other;
+        struct deque *d;
+
+        if (pool.threads == 1) {
+                return;
+        }
+
+        pthread_mutex_lock(&pool.lock);
+        d = own_deque();
+
+        if (take_back(d, task)) {
+                pthread_mutex_unlock(&pool.lock);
+                task->fn(task->arg);
+                return;
+        }
+
+        /* Stolen: help out until the thief is done. */
+        while (!task->done) {
+                other = find_task(d);
+                if (other != NULL) {
+                        run(other);
+                } else {
+                        pthread_cond_wait(&pool.cond, &pool.lock);
+                }
+        }
+        pthread_mutex_unlock(&pool.lock);
+}
@@ -0,0 +1,36 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdbool.h>
+
+/*
+   A pool of worker threads for fork-join parallelism. Each worker keeps the
+   tasks it forks on a deque of its own and runs the newest first, while idle
+   threads steal the oldest from the others; threads outside the pool share a
+   deque. A thread waiting in pool_join() runs other tasks in the meantime.
+ */
+struct pool_task {
+        void (*fn)(void *arg);
+        void *arg;
+        bool done;
+};
+
+/* Start the pool with threads - 1 workers, which together with the calling
+   thread make threads. Each worker calls cleanup, if not NULL, on exit. */
+void pool_start(int threads, void (*cleanup)(void));
+
+/* Stop the workers. No tasks may be pending. */
+void pool_stop(void);
+
+/* Get the number of threads that pool_start() was given, or 1. */
+int pool_threads(void);
+
+/* Start fn(arg) as task, which another thread may take over. Without
+   workers, it runs right away. */
+void pool_fork(struct pool_task *task, void (*fn)(void *arg), void *arg);
+
+/* Wait for the forked task to finish, running it here unless another thread
+   took it. */
+void pool_join(struct pool_task *task);
+
+#endif